@@ -0,0 +1,393 @@
+/**
+ * @file aesd-arena.c
+ * @brief Chunked arena for aesdchar write payloads.
+ *
+ * A write is copied once, straight to the tail of the current chunk right behind the partial packet of earlier
+ * writes, and its complete packets become entries pointing into the chunk.  Only a write that does not fit behind
+ * the partial packet allocates, so aesd_write_iter makes at most one allocation.  A partial packet that outgrows its
+ * chunk moves to one twice its size, so a packet trickled in small writes is moved O(log n) times and appends cost
+ * O(count) amortized.  Entries are evicted in the order they were carved, so chunks drain front to back and are
+ * freed when their last entry goes.  Since an entry keeps its whole chunk alive, an arena's first chunk only fits its
+ * first write and later ones double up to chunk_size.
+ *
+ * Builds in userspace as well, where it is unit tested.  Any necessary locking of the arena must be performed by the
+ * caller, chunk references are atomic.
+ * In the kernel, chunks of an arena with an srcu are freed after an SRCU grace period, readers copy entries out of
+ * them without the caller's lock.
+ *
+ * Arenas may share a struct aesd_arena_cache.  Their chunks of a size class then go back to the cache when freed,
+ * and the next chunk of that class is taken from it, so a steady stream of writes keeps reusing the chunks of
+ * evicted entries.  The classes go below chunk_size too, so the small first chunks of arenas written once, one per
+ * open of the device for a single echo, are reused as well.
+ */
+
+#ifdef __KERNEL__
+#include <linux/limits.h>
+#include <linux/mm.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+#define ALLOC_CHUNK(size) kvmalloc(size, GFP_KERNEL)
+#define FREE_CHUNK(x) kvfree(x)
+#else
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#define ALLOC_CHUNK(size) malloc(size)
+#define FREE_CHUNK(x) free(x)
+#endif
+
+#include "aesd-arena.h"
+
+#ifdef __KERNEL__
+// chunks are released from SRCU callbacks, so the cache lock must be taken with interrupts off
+static unsigned long cache_lock(struct aesd_arena_cache *cache) {
+  unsigned long flags;
+  spin_lock_irqsave(&cache->lock, flags);
+  return flags;
+}
+
+static void cache_unlock(struct aesd_arena_cache *cache, unsigned long flags) {
+  spin_unlock_irqrestore(&cache->lock, flags);
+}
+#else
+static unsigned long cache_lock(struct aesd_arena_cache *cache) {
+  while (__atomic_test_and_set(&cache->lock, __ATOMIC_ACQUIRE)) {
+  }
+  return 0;
+}
+
+static void cache_unlock(struct aesd_arena_cache *cache, unsigned long flags) {
+  __atomic_clear(&cache->lock, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * @return the bytes allocated for @param chunk, its header included
+ */
+static size_t chunk_bytes(const struct aesd_arena_chunk *chunk) {
+  return sizeof(struct aesd_arena_chunk) + chunk->size;
+}
+
+/**
+ * @return @param bytes rounded up to a power of two, which is what kmalloc and the page allocator hand out anyway,
+ * or bytes itself if that would overflow
+ */
+static size_t round_chunk_bytes(size_t bytes) {
+  size_t rounded = 1;
+
+  while (rounded < bytes && rounded <= SIZE_MAX / 2) {
+    rounded <<= 1;
+  }
+  return rounded >= bytes ? rounded : bytes;
+}
+
+/**
+ * @return the bytes allocated for chunks of size class @param class of @param cache
+ */
+static size_t cache_class_bytes(const struct aesd_arena_cache *cache, int class) {
+  if (class < AESD_ARENA_CACHE_SMALL_CLASSES) {
+    return cache->chunk_size >> (AESD_ARENA_CACHE_SMALL_CLASSES - class);
+  }
+  return cache->chunk_size << (class - AESD_ARENA_CACHE_SMALL_CLASSES);
+}
+
+/**
+ * @return the size class of @param cache allocations of @param bytes belong to, or -1 if they are of none
+ */
+static int cache_class(const struct aesd_arena_cache *cache, size_t bytes) {
+  for (int class = 0; class < AESD_ARENA_CACHE_CLASSES; class++) {
+    if (bytes == cache_class_bytes(cache, class)) {
+      return class;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Keeps @param chunk in its cache if it is of a size class and the cache has room
+ * @return true if the cache took the chunk
+ */
+static bool cache_put(struct aesd_arena_chunk *chunk) {
+  struct aesd_arena_cache *cache = chunk->cache;
+  int class = cache_class(cache, chunk_bytes(chunk));
+  bool kept = false;
+
+  if (class < 0) {
+    return false;
+  }
+  unsigned long flags = cache_lock(cache);
+  if (cache->bytes + chunk_bytes(chunk) <= cache->max_bytes) {
+    chunk->next = cache->free[class];
+    cache->free[class] = chunk;
+    cache->bytes += chunk_bytes(chunk);
+    cache->count++;
+    kept = true;
+  }
+  cache_unlock(cache, flags);
+  return kept;
+}
+
+static void release_chunk(struct aesd_arena_chunk *chunk) {
+  if (chunk->cache == NULL || !cache_put(chunk)) {
+    FREE_CHUNK(chunk);
+  }
+}
+
+#ifdef __KERNEL__
+static void release_chunk_rcu(struct rcu_head *head) {
+  release_chunk(container_of(head, struct aesd_arena_chunk, rcu));
+}
+#endif
+
+/**
+ * Releases @param chunk once its last reference is gone, after the readers that may still use it
+ */
+static void drop_chunk(struct aesd_arena_chunk *chunk) {
+#ifdef __KERNEL__
+  if (chunk->srcu != NULL) {
+    call_srcu(chunk->srcu, &chunk->rcu, release_chunk_rcu);
+    return;
+  }
+#endif
+  release_chunk(chunk);
+}
+
+/**
+ * Gets a chunk with room for @param size bytes for @param arena, at least next_chunk_size bytes large with its
+ * header, and doubles next_chunk_size up to chunk_size.  The allocation is rounded up to a power of two, header
+ * included, so none of what the allocator hands out is wasted; chunk sizes of the cache classes are taken from the
+ * arena's cache first.
+ * @return the chunk with only its data uninitialized, or NULL if no memory
+ */
+static struct aesd_arena_chunk *alloc_chunk(struct aesd_arena *arena, size_t size) {
+  struct aesd_arena_cache *cache = arena->cache;
+  struct aesd_arena_chunk *chunk = NULL;
+
+  if (size > SIZE_MAX - sizeof(struct aesd_arena_chunk)) {
+    return NULL;
+  }
+  size_t bytes = round_chunk_bytes(size + sizeof(struct aesd_arena_chunk));
+  if (bytes < arena->next_chunk_size) {
+    bytes = arena->next_chunk_size;
+  }
+  if (cache != NULL) {
+    int class = cache_class(cache, bytes);
+    if (class >= 0) {
+      unsigned long flags = cache_lock(cache);
+      chunk = cache->free[class];
+      if (chunk != NULL) {
+        cache->free[class] = chunk->next;
+        cache->bytes -= bytes;
+        cache->count--;
+      }
+      cache_unlock(cache, flags);
+    }
+  }
+  if (chunk == NULL) {
+    chunk = ALLOC_CHUNK(bytes);
+    if (chunk == NULL) {
+      return NULL;
+    }
+  }
+  chunk->size = bytes - sizeof(struct aesd_arena_chunk);
+  arena->next_chunk_size = bytes < arena->chunk_size / 2 ? bytes * 2 : arena->chunk_size;
+  chunk->cache = cache;
+#ifdef __KERNEL__
+  chunk->srcu = arena->srcu;
+#endif
+  return chunk;
+}
+
+/**
+ * Initializes @param cache to keep up to @param max_bytes of chunks, headers included, for arenas of
+ * @param chunk_size, a power of two
+ */
+void aesd_arena_cache_init(struct aesd_arena_cache *cache, size_t chunk_size, size_t max_bytes) {
+  for (int class = 0; class < AESD_ARENA_CACHE_CLASSES; class++) {
+    cache->free[class] = NULL;
+  }
+  cache->chunk_size = chunk_size;
+  cache->max_bytes = max_bytes;
+  cache->bytes = 0;
+  cache->count = 0;
+#ifdef __KERNEL__
+  spin_lock_init(&cache->lock);
+#else
+  cache->lock = false;
+#endif
+}
+
+/**
+ * Frees up to @param count chunks held by @param cache, the largest ones first
+ * @return the number of chunks freed
+ */
+unsigned long aesd_arena_cache_shrink(struct aesd_arena_cache *cache, unsigned long count) {
+  struct aesd_arena_chunk *freed = NULL;
+  unsigned long freed_count = 0;
+
+  unsigned long flags = cache_lock(cache);
+  for (int class = AESD_ARENA_CACHE_CLASSES - 1; class >= 0 && freed_count < count; class--) {
+    while (cache->free[class] != NULL && freed_count < count) {
+      struct aesd_arena_chunk *chunk = cache->free[class];
+      cache->free[class] = chunk->next;
+      cache->bytes -= chunk_bytes(chunk);
+      cache->count--;
+      chunk->next = freed;
+      freed = chunk;
+      freed_count++;
+    }
+  }
+  cache_unlock(cache, flags);
+
+  while (freed != NULL) {
+    struct aesd_arena_chunk *chunk = freed;
+    freed = chunk->next;
+    FREE_CHUNK(chunk);
+  }
+  return freed_count;
+}
+
+/**
+ * Frees the chunks held by @param cache.  No chunk of an arena using it may be released afterwards.
+ */
+void aesd_arena_cache_destroy(struct aesd_arena_cache *cache) { aesd_arena_cache_shrink(cache, ULONG_MAX); }
+
+/**
+ * Initializes @param arena to allocate chunks of @param chunk_size bytes including their header, or larger ones for
+ * larger writes.  A power of two fits the allocator exactly.  The first chunks are smaller, see next_chunk_size.
+ */
+void aesd_arena_init(struct aesd_arena *arena, size_t chunk_size) {
+  arena->current = NULL;
+  arena->spare_refs = 0;
+  arena->chunk_size = chunk_size;
+  arena->next_chunk_size = 0;
+#ifdef __KERNEL__
+  arena->srcu = NULL;
+#endif
+  arena->cache = NULL;
+}
+
+/**
+ * Drops the arena's reference on its current chunk.  Chunks still referenced by spans are freed by their last
+ * aesd_arena_put.
+ */
+void aesd_arena_destroy(struct aesd_arena *arena) {
+  if (arena->current != NULL) {
+    aesd_arena_put_many(arena->current, arena->spare_refs + 1);
+    arena->current = NULL;
+    arena->spare_refs = 0;
+  }
+}
+
+#ifdef __KERNEL__
+void aesd_arena_get(struct aesd_arena_chunk *chunk) { refcount_inc(&chunk->refs); }
+
+/**
+ * Drops @param refs references on @param chunk at once, freeing it if they were the last
+ */
+void aesd_arena_put_many(struct aesd_arena_chunk *chunk, unsigned int refs) {
+  if (refcount_sub_and_test(refs, &chunk->refs)) {
+    drop_chunk(chunk);
+  }
+}
+#else
+void aesd_arena_get(struct aesd_arena_chunk *chunk) { __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED); }
+
+/**
+ * Drops @param refs references on @param chunk at once, freeing it if they were the last
+ */
+void aesd_arena_put_many(struct aesd_arena_chunk *chunk, unsigned int refs) {
+  if (__atomic_sub_fetch(&chunk->refs, refs, __ATOMIC_ACQ_REL) == 0) {
+    drop_chunk(chunk);
+  }
+}
+#endif
+
+void aesd_arena_put(struct aesd_arena_chunk *chunk) { aesd_arena_put_many(chunk, 1); }
+
+/**
+ * Takes a reference on the current chunk of @param arena from its spare references, refilling them when there are
+ * none left, so a write starting a new span after its packet went to an entry doesn't touch the atomic count
+ */
+static void arena_get_current(struct aesd_arena *arena) {
+  if (arena->spare_refs == 0) {
+#ifdef __KERNEL__
+    refcount_add(AESD_ARENA_SPARE_REFS, &arena->current->refs);
+#else
+    __atomic_add_fetch(&arena->current->refs, AESD_ARENA_SPARE_REFS, __ATOMIC_RELAXED);
+#endif
+    arena->spare_refs = AESD_ARENA_SPARE_REFS;
+  }
+  arena->spare_refs--;
+}
+
+/**
+ * Makes room for @param count bytes right after the bytes of @param span, which is either empty or was built by
+ * earlier reservations and commits.  A span already at the tail of the current chunk grows in place.  Otherwise a
+ * new chunk becomes current and the span's bytes are moved to its front.
+ * @param span on return owner holds a reference on the chunk containing the span, whose buffptr may have moved
+ * @return where the count new bytes go, they become part of span with aesd_arena_commit, or NULL if no memory
+ */
+char *aesd_arena_reserve(struct aesd_arena *arena, struct aesd_buffer_entry *span, size_t count) {
+  struct aesd_arena_chunk *chunk = arena->current;
+
+  if (chunk != NULL && chunk->size - chunk->used >= count) {
+    if (span->size == 0) {
+      if (span->owner != chunk) {
+        if (span->owner != NULL) {
+          aesd_arena_put(span->owner);
+        }
+        arena_get_current(arena);
+        span->owner = chunk;
+      }
+      span->buffptr = chunk->data + chunk->used;
+      return chunk->data + chunk->used;
+    }
+    if (span->owner == chunk && span->buffptr + span->size == chunk->data + chunk->used) {
+      return chunk->data + chunk->used;
+    }
+  }
+
+  size_t size = span->size + count;
+  if (span->size > 0 && size <= SIZE_MAX / 2 - sizeof(struct aesd_arena_chunk)) {
+    // leave room for the rest of a growing packet
+    size *= 2;
+  }
+  chunk = alloc_chunk(arena, size);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->used = span->size;
+#ifdef __KERNEL__
+  refcount_set(&chunk->refs, 2); // the arena and span
+#else
+  chunk->refs = 2; // the arena and span
+#endif
+  if (span->size > 0) {
+    memcpy(chunk->data, span->buffptr, span->size);
+  }
+
+  if (span->owner != NULL) {
+    aesd_arena_put(span->owner);
+  }
+  span->owner = chunk;
+  span->buffptr = chunk->data;
+  if (arena->current != NULL) {
+    aesd_arena_put_many(arena->current, arena->spare_refs + 1);
+  }
+  arena->current = chunk;
+  arena->spare_refs = 0;
+  return chunk->data + chunk->used;
+}
+
+/**
+ * Appends the @param count bytes written to the last aesd_arena_reserve for @param span to it
+ */
+void aesd_arena_commit(struct aesd_arena *arena, struct aesd_buffer_entry *span, size_t count) {
+  arena->current->used += count;
+  span->size += count;
+}
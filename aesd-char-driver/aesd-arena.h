@@ -0,0 +1,169 @@
+/*
+ * aesd-arena.h
+ *
+ * Chunked arena the aesdchar driver carves write payloads from.
+ */
+
+#ifndef AESD_ARENA_H
+#define AESD_ARENA_H
+
+#ifdef __KERNEL__
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#endif
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * Bytes allocated for a regular arena chunk, header included, larger writes get a chunk of their own
+ */
+#define AESD_ARENA_CHUNK_SIZE (16 * 1024)
+/**
+ * Size classes of struct aesd_arena_cache below chunk_size, for the first chunks of an arena that start at the size of
+ * its first write, allocated with chunk_size >> 8 up to chunk_size >> 1 bytes
+ */
+#define AESD_ARENA_CACHE_SMALL_CLASSES 8
+/**
+ * Size classes of struct aesd_arena_cache, every power of two from chunk_size >> AESD_ARENA_CACHE_SMALL_CLASSES up to
+ * chunk_size << 3
+ */
+#define AESD_ARENA_CACHE_CLASSES (AESD_ARENA_CACHE_SMALL_CLASSES + 4)
+/**
+ * References an arena takes on its current chunk at once to hand to the spans starting in it
+ */
+#define AESD_ARENA_SPARE_REFS 64
+
+struct aesd_arena_cache;
+
+/**
+ * A block of memory payloads are carved from front to back.  Every span pointing into the chunk holds a
+ * reference, and so does the arena while the chunk is the one new bytes go to; the chunk is freed with the last.
+ * Only the arena's owner carves from a chunk, while references may be dropped by anyone.
+ */
+struct aesd_arena_chunk {
+  /**
+   * Number of bytes in data
+   */
+  size_t size;
+  /**
+   * Number of bytes of data handed out
+   */
+  size_t used;
+  /**
+   * Number of references held on the chunk, spans of different arenas may share it so it is atomic
+   */
+#ifdef __KERNEL__
+  refcount_t refs;
+#else
+  unsigned int refs;
+#endif
+#ifdef __KERNEL__
+  /**
+   * Readers that may still be copying from the chunk when its last reference goes, the chunk is freed after them
+   */
+  struct srcu_struct *srcu;
+  struct rcu_head rcu;
+#endif
+  /**
+   * Cache the chunk goes back to instead of being freed, NULL if none
+   */
+  struct aesd_arena_cache *cache;
+  /**
+   * Next chunk of the same size class while the chunk sits in the cache
+   */
+  struct aesd_arena_chunk *next;
+  char data[];
+};
+
+/**
+ * Chunks whose last reference went, kept for reuse by the arenas sharing the cache so that steady writing doesn't
+ * go through the allocator.  Only chunks of a size class are kept, up to max_bytes in all, and a shrinker can take
+ * them back with aesd_arena_cache_shrink.  References may be dropped in any context, so the lists have a lock of
+ * their own.
+ */
+struct aesd_arena_cache {
+  /**
+   * Cached chunks of each size class, smallest first, linked through next
+   */
+  struct aesd_arena_chunk *free[AESD_ARENA_CACHE_CLASSES];
+  /**
+   * The chunk_size of the arenas using the cache, the classes are powers of two around it
+   */
+  size_t chunk_size;
+  /**
+   * Bytes of chunks held at most, headers included, 0 disables the cache
+   */
+  size_t max_bytes;
+  /**
+   * Bytes allocated for the chunks held
+   */
+  size_t bytes;
+  /**
+   * Number of chunks held
+   */
+  unsigned long count;
+#ifdef __KERNEL__
+  spinlock_t lock;
+#else
+  bool lock;
+#endif
+};
+
+struct aesd_arena {
+  /**
+   * The chunk new bytes are appended to, NULL until the first reservation
+   */
+  struct aesd_arena_chunk *current;
+  /**
+   * References held on current besides the arena's own, given to spans starting in it without an atomic operation
+   * and dropped along with the arena's reference
+   */
+  unsigned int spare_refs;
+  /**
+   * Bytes allocated for a chunk at least once the arena has grown, its header included
+   */
+  size_t chunk_size;
+  /**
+   * Bytes allocated for the next chunk at least.  The first chunk only fits the first write, each new one doubles
+   * up to chunk_size, so an arena written once, like the one of a file opened for a single echo, doesn't keep a
+   * whole chunk alive for a few bytes.
+   */
+  size_t next_chunk_size;
+#ifdef __KERNEL__
+  /**
+   * Set by the caller when chunks are read without its lock, freeing a chunk then waits for these readers
+   */
+  struct srcu_struct *srcu;
+#endif
+  /**
+   * Set by the caller to take chunks from and return them to a cache, NULL to use the allocator directly
+   */
+  struct aesd_arena_cache *cache;
+};
+
+extern void aesd_arena_init(struct aesd_arena *arena, size_t chunk_size);
+
+extern void aesd_arena_destroy(struct aesd_arena *arena);
+
+extern char *aesd_arena_reserve(struct aesd_arena *arena, struct aesd_buffer_entry *span, size_t count);
+
+extern void aesd_arena_commit(struct aesd_arena *arena, struct aesd_buffer_entry *span, size_t count);
+
+extern void aesd_arena_get(struct aesd_arena_chunk *chunk);
+
+extern void aesd_arena_put(struct aesd_arena_chunk *chunk);
+
+extern void aesd_arena_put_many(struct aesd_arena_chunk *chunk, unsigned int refs);
+
+extern void aesd_arena_cache_init(struct aesd_arena_cache *cache, size_t chunk_size, size_t max_bytes);
+
+extern unsigned long aesd_arena_cache_shrink(struct aesd_arena_cache *cache, unsigned long count);
+
+extern void aesd_arena_cache_destroy(struct aesd_arena_cache *cache);
+
+#endif /* AESD_ARENA_H */
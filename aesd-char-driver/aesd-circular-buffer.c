@@ -9,16 +9,83 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/mm.h>
+#include <linux/preempt.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #define FREE(x) kfree_const(x)
+#define ALLOC_ENTRIES(n) kvcalloc(n, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define FREE_ENTRIES(x) kvfree(x)
+#define LOAD(x) READ_ONCE(x)
+#define STORE(x, value) WRITE_ONCE(x, value)
 #else
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #define FREE(x) free(x)
+#define ALLOC_ENTRIES(n) calloc(n, sizeof(struct aesd_buffer_entry))
+#define FREE_ENTRIES(x) free(x)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, value) __atomic_store_n(&(x), value, __ATOMIC_RELAXED)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/*
+ * The seqcount protocol.  Fields snapshots read are accessed with LOAD and STORE so the compiler neither tears nor
+ * caches them, the userspace build mirrors the barriers of the kernel seqcount_t.
+ */
+#ifdef __KERNEL__
+static void write_begin(struct aesd_circular_buffer *buffer) {
+  // readers spin while the count is odd, don't get preempted in between
+  preempt_disable();
+  write_seqcount_begin(&buffer->seqcount);
+}
+
+static void write_end(struct aesd_circular_buffer *buffer) {
+  write_seqcount_end(&buffer->seqcount);
+  preempt_enable();
+}
+
+static unsigned int read_begin(struct aesd_circular_buffer *buffer) { return read_seqcount_begin(&buffer->seqcount); }
+
+static bool read_retry(struct aesd_circular_buffer *buffer, unsigned int start) {
+  return read_seqcount_retry(&buffer->seqcount, start);
+}
+#else
+static void write_begin(struct aesd_circular_buffer *buffer) {
+  STORE(buffer->seqcount, buffer->seqcount + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct aesd_circular_buffer *buffer) {
+  __atomic_store_n(&buffer->seqcount, buffer->seqcount + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int read_begin(struct aesd_circular_buffer *buffer) {
+  unsigned int start;
+  while ((start = __atomic_load_n(&buffer->seqcount, __ATOMIC_ACQUIRE)) & 1) {
+  }
+  return start;
+}
+
+static bool read_retry(struct aesd_circular_buffer *buffer, unsigned int start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return LOAD(buffer->seqcount) != start;
+}
+#endif
+
+static void load_entry(struct aesd_buffer_entry *entry_rtn, const struct aesd_buffer_entry *entry) {
+  entry_rtn->buffptr = LOAD(entry->buffptr);
+  entry_rtn->size = LOAD(entry->size);
+  entry_rtn->offset = LOAD(entry->offset);
+  entry_rtn->owner = LOAD(entry->owner);
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -32,43 +99,380 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                           size_t char_offset,
                                                                           size_t *entry_offset_byte_rtn) {
-  uint8_t count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-  uint8_t offset = buffer->out_offs;
-  while (char_offset >= 0 && ((buffer->full && count-- > 0) || (offset != buffer->in_offs))) {
-    if (char_offset < buffer->entry[offset].size) {
-      *entry_offset_byte_rtn = char_offset;
-      return &buffer->entry[offset];
+  uint32_t index;
+  return aesd_circular_buffer_find_index_for_fpos(buffer, char_offset, &index, entry_offset_byte_rtn);
+}
+
+/**
+ * Like aesd_circular_buffer_find_entry_offset_for_fpos, and also stores in @param index_rtn how many writes after
+ * the oldest one the returned entry is, so a caller can continue with the following entries.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+                                                                   size_t char_offset, uint32_t *index_rtn,
+                                                                   size_t *entry_offset_byte_rtn) {
+  uint32_t out_offs = LOAD(buffer->out_offs);
+  size_t evicted_bytes = LOAD(buffer->evicted_bytes);
+  uint32_t low = 0;
+  uint32_t high = LOAD(buffer->in_offs) - out_offs;
+  struct aesd_buffer_entry *entry;
+
+  if (char_offset >= LOAD(buffer->written_bytes) - evicted_bytes) {
+    return NULL;
+  }
+
+  // find the last entry starting at or before char_offset, empty entries share their offset with the next one
+  while (high - low > 1) {
+    uint32_t middle = low + (high - low) / 2;
+    if (LOAD(buffer->entry[(out_offs + middle) & buffer->mask].offset) - evicted_bytes <= char_offset) {
+      low = middle;
+    } else {
+      high = middle;
     }
-    char_offset -= buffer->entry[offset].size;
-    offset = (offset + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
   }
-  return NULL;
+  entry = &buffer->entry[(out_offs + low) & buffer->mask];
+  *index_rtn = low;
+  *entry_offset_byte_rtn = char_offset - (LOAD(entry->offset) - evicted_bytes);
+  return entry;
+}
+
+/**
+ * Removes the oldest entry of @param buffer, which must not be empty.
+ * @return the entry, for the caller to free what it references
+ */
+static struct aesd_buffer_entry evict_oldest(struct aesd_circular_buffer *buffer) {
+  struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs & buffer->mask];
+  struct aesd_buffer_entry evicted = *oldest;
+  write_begin(buffer);
+  STORE(buffer->evicted_bytes, buffer->evicted_bytes + oldest->size);
+  STORE(oldest->buffptr, NULL);
+  STORE(oldest->size, 0);
+  STORE(oldest->owner, NULL);
+  STORE(buffer->out_offs, buffer->out_offs + 1);
+  write_end(buffer);
+  buffer->full = false;
+  return evicted;
+}
+
+/**
+ * Evicts the oldest entries of @param buffer, as one batch, until at most @param keep_entries entries holding at
+ * most @param keep_bytes bytes are left, handing each evicted entry to @param release.
+ */
+static void evict_to(struct aesd_circular_buffer *buffer, uint32_t keep_entries, size_t keep_bytes,
+                     aesd_circular_buffer_release_fn release, void *context) {
+  while (aesd_circular_buffer_count(buffer) > keep_entries ||
+         (aesd_circular_buffer_count(buffer) > 0 && aesd_circular_buffer_size(buffer) > keep_bytes)) {
+    struct aesd_buffer_entry evicted = evict_oldest(buffer);
+    if (release != NULL) {
+      release(&evicted, context);
+    }
+  }
+}
+
+static void insert_newest(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry) {
+  struct aesd_buffer_entry *newest = &buffer->entry[buffer->in_offs & buffer->mask];
+  write_begin(buffer);
+  STORE(newest->buffptr, add_entry->buffptr);
+  STORE(newest->size, add_entry->size);
+  STORE(newest->offset, buffer->written_bytes);
+  STORE(newest->owner, add_entry->owner);
+  STORE(buffer->written_bytes, buffer->written_bytes + add_entry->size);
+  STORE(buffer->in_offs, buffer->in_offs + 1);
+  write_end(buffer);
+  buffer->full = buffer->in_offs - buffer->out_offs == buffer->capacity;
 }
 
 /**
  * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
  * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
- * new start location.
+ * new start location.  Only the capacity is enforced, the retention policy needs
+ * aesd_circular_buffer_add_entry_evict since it can evict more than one entry.
  * Any necessary locking must be handled by the caller
  * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+ * @return the buffptr of the entry that was overwritten, for the caller to free, or NULL
  */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
                                            const struct aesd_buffer_entry *add_entry) {
-  const char *buffptr = buffer->full ? buffer->entry[buffer->in_offs].buffptr : NULL;
-  buffer->entry[buffer->in_offs] = *add_entry;
-  buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-  if (buffer->full == 1) {
-    buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    return buffptr;
-  } else if (buffer->in_offs == buffer->out_offs) {
-    buffer->full = 1;
+  const char *buffptr = buffer->full ? evict_oldest(buffer).buffptr : NULL;
+  insert_newest(buffer, add_entry);
+  return buffptr;
+}
+
+/**
+ * Adds entry @param add_entry to @param buffer after evicting the oldest entries the retention policy requires to
+ * make room for it.  The new entry is kept even when it alone exceeds max_bytes.
+ * Any necessary locking must be handled by the caller
+ * @param release is called with every evicted entry, it may be NULL
+ */
+void aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer,
+                                          const struct aesd_buffer_entry *add_entry,
+                                          aesd_circular_buffer_release_fn release, void *context) {
+  size_t keep_bytes = SIZE_MAX;
+  if (buffer->max_bytes > 0) {
+    keep_bytes = add_entry->size < buffer->max_bytes ? buffer->max_bytes - add_entry->size : 0;
+  }
+  evict_to(buffer, buffer->max_entries - 1, keep_bytes, release, context);
+  insert_newest(buffer, add_entry);
+}
+
+/**
+ * Sets the retention policy of @param buffer and evicts the oldest entries it no longer allows.
+ * Any necessary locking must be handled by the caller
+ * @param max_entries the number of entries kept, 0 for the capacity
+ * @param max_bytes the bytes kept, 0 for no limit
+ * @param release is called with every evicted entry, it may be NULL
+ * @return 0 on success, -EINVAL if max_entries is above the capacity
+ */
+int aesd_circular_buffer_set_retention(struct aesd_circular_buffer *buffer, uint32_t max_entries, size_t max_bytes,
+                                       aesd_circular_buffer_release_fn release, void *context) {
+  if (max_entries > buffer->capacity) {
+    return -EINVAL;
   }
-  return NULL;
+  buffer->max_entries = max_entries > 0 ? max_entries : buffer->capacity;
+  buffer->max_bytes = max_bytes;
+  evict_to(buffer, buffer->max_entries, max_bytes > 0 ? max_bytes : SIZE_MAX, release, context);
+  return 0;
 }
 
 /**
- * Initializes the circular buffer described by @param buffer to an empty struct
+ * Initializes the circular buffer described by @param buffer to an empty struct holding
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
  */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer) {
+  aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to @param capacity
+ * entries.  Capacities above AESDCHAR_INLINE_ENTRIES allocate their slots, which aesd_circular_buffer_destroy frees.
+ * @return 0 on success, -EINVAL if capacity is 0 or above AESDCHAR_MAX_CAPACITY, -ENOMEM if slots can't be allocated
+ */
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity) {
+  uint32_t slots = 1;
+
   memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+#ifdef __KERNEL__
+  seqcount_init(&buffer->seqcount);
+#endif
+  if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) {
+    return -EINVAL;
+  }
+  while (slots < capacity) {
+    slots <<= 1;
+  }
+
+  if (slots <= AESDCHAR_INLINE_ENTRIES) {
+    buffer->entry = buffer->inline_entry;
+  } else {
+    buffer->entry = ALLOC_ENTRIES(slots);
+    if (buffer->entry == NULL) {
+      return -ENOMEM;
+    }
+  }
+  buffer->capacity = capacity;
+  buffer->max_entries = capacity;
+  buffer->mask = slots - 1;
+  return 0;
+}
+
+/**
+ * Releases the slots of @param buffer.  Memory referenced by the entries is owned by the caller and must be freed
+ * before, for example with AESD_CIRCULAR_BUFFER_FOREACH.
+ */
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer) {
+  if (buffer->entry != buffer->inline_entry) {
+    FREE_ENTRIES(buffer->entry);
+  }
+  buffer->entry = NULL;
+  buffer->in_offs = buffer->out_offs = 0;
+  buffer->written_bytes = buffer->evicted_bytes = 0;
+  buffer->full = false;
+}
+
+/**
+ * @return the number of entries in @param buffer
+ */
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer) {
+  return LOAD(buffer->in_offs) - LOAD(buffer->out_offs);
+}
+
+/**
+ * @return the entry @param index writes after the oldest one in @param buffer, or NULL if there are not that many
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t index) {
+  if (index >= aesd_circular_buffer_count(buffer)) {
+    return NULL;
+  }
+  return &buffer->entry[(LOAD(buffer->out_offs) + index) & buffer->mask];
+}
+
+/**
+ * @return the number of bytes held by the entries of @param buffer, in constant time
+ */
+size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer) {
+  return LOAD(buffer->written_bytes) - LOAD(buffer->evicted_bytes);
+}
+
+/**
+ * Locates byte @param char_offset of @param buffer without the writer's lock.
+ * @param position set to the byte when it is found
+ * @return false if the buffer holds fewer bytes
+ */
+bool aesd_circular_buffer_snapshot_fpos(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                        struct aesd_buffer_position *position) {
+  unsigned int start;
+  bool found;
+
+  do {
+    uint32_t index;
+    start = read_begin(buffer);
+    found = aesd_circular_buffer_find_index_for_fpos(buffer, char_offset, &index, &position->offset) != NULL;
+    if (found) {
+      position->generation = LOAD(buffer->out_offs);
+      position->seq = position->generation + index;
+    }
+  } while (read_retry(buffer, start));
+  return found;
+}
+
+/**
+ * Copies the entry @param index writes after the oldest one in @param buffer without the writer's lock.
+ * @param position set to the first byte of the entry
+ * @param fpos_rtn set to the fpos of that byte
+ * @return false if there are not that many entries
+ */
+bool aesd_circular_buffer_snapshot_index(struct aesd_circular_buffer *buffer, uint32_t index,
+                                         struct aesd_buffer_position *position, size_t *fpos_rtn,
+                                         struct aesd_buffer_entry *entry_rtn) {
+  struct aesd_buffer_entry *entry;
+  unsigned int start;
+  bool found;
+
+  do {
+    start = read_begin(buffer);
+    entry = aesd_circular_buffer_entry_at(buffer, index);
+    found = entry != NULL;
+    if (found) {
+      load_entry(entry_rtn, entry);
+      position->generation = LOAD(buffer->out_offs);
+      position->seq = position->generation + index;
+      position->offset = 0;
+      *fpos_rtn = entry_rtn->offset - LOAD(buffer->evicted_bytes);
+    }
+  } while (read_retry(buffer, start));
+  return found;
+}
+
+/**
+ * Copies the entry holding @param position out of @param buffer without the writer's lock.
+ * @return 0 on success, -ENOENT if the position is past the newest entry, -ESTALE if entries were evicted since
+ * the position was taken and its fpos needs to be looked up again
+ */
+int aesd_circular_buffer_snapshot_entry(struct aesd_circular_buffer *buffer,
+                                        const struct aesd_buffer_position *position,
+                                        struct aesd_buffer_entry *entry_rtn) {
+  uint32_t out_offs;
+  unsigned int start;
+  int retval;
+
+  do {
+    start = read_begin(buffer);
+    out_offs = LOAD(buffer->out_offs);
+    if (out_offs != position->generation) {
+      retval = -ESTALE;
+    } else if (position->seq - out_offs >= LOAD(buffer->in_offs) - out_offs) {
+      retval = -ENOENT;
+    } else {
+      load_entry(entry_rtn, &buffer->entry[position->seq & buffer->mask]);
+      retval = 0;
+    }
+  } while (read_retry(buffer, start));
+  return retval;
+}
+
+/**
+ * Copies write @param seq, counted from the first write ever like aesd_buffer_position.seq, out of @param buffer
+ * without the writer's lock.  Unlike aesd_circular_buffer_snapshot_entry it does not care whether other entries
+ * were evicted since seq was found, so a range of writes can be walked while a writer keeps evicting older ones.
+ * @return 0 on success, -ENOENT if seq was not written yet, -ESTALE if it was evicted
+ */
+int aesd_circular_buffer_snapshot_seq(struct aesd_circular_buffer *buffer, uint32_t seq,
+                                      struct aesd_buffer_entry *entry_rtn) {
+  uint32_t out_offs;
+  unsigned int start;
+  int retval;
+
+  do {
+    start = read_begin(buffer);
+    out_offs = LOAD(buffer->out_offs);
+    if ((int32_t)(seq - out_offs) < 0) {
+      retval = -ESTALE;
+    } else if (seq - out_offs >= LOAD(buffer->in_offs) - out_offs) {
+      retval = -ENOENT;
+    } else {
+      load_entry(entry_rtn, &buffer->entry[seq & buffer->mask]);
+      retval = 0;
+    }
+  } while (read_retry(buffer, start));
+  return retval;
+}
+
+/**
+ * Sets @param position to the end of @param buffer, where the next write will go, without the writer's lock.
+ * @param fpos_rtn set to the fpos of the end, the size of the buffer
+ */
+void aesd_circular_buffer_snapshot_end(struct aesd_circular_buffer *buffer, struct aesd_buffer_position *position,
+                                       size_t *fpos_rtn) {
+  unsigned int start;
+
+  do {
+    start = read_begin(buffer);
+    position->generation = LOAD(buffer->out_offs);
+    position->seq = LOAD(buffer->in_offs);
+    position->offset = 0;
+    *fpos_rtn = aesd_circular_buffer_size(buffer);
+  } while (read_retry(buffer, start));
+}
+
+/**
+ * Moves @param position, taken before entries were evicted, to the current generation without the writer's lock.
+ * It stays on the same byte unless that was evicted too, then it moves to the start of the oldest entry.
+ * @param fpos_rtn set to the fpos of the position now
+ */
+void aesd_circular_buffer_snapshot_rebase(struct aesd_circular_buffer *buffer, struct aesd_buffer_position *position,
+                                          size_t *fpos_rtn) {
+  struct aesd_buffer_position rebased;
+  uint32_t in_offs;
+  unsigned int start;
+
+  do {
+    start = read_begin(buffer);
+    rebased = *position;
+    rebased.generation = LOAD(buffer->out_offs);
+    in_offs = LOAD(buffer->in_offs);
+    if (rebased.seq - rebased.generation > in_offs - rebased.generation) {
+      rebased.seq = rebased.generation;
+      rebased.offset = 0;
+    }
+    if (rebased.seq == in_offs) {
+      *fpos_rtn = aesd_circular_buffer_size(buffer);
+    } else {
+      *fpos_rtn = LOAD(buffer->entry[rebased.seq & buffer->mask].offset) - LOAD(buffer->evicted_bytes) +
+                  rebased.offset;
+    }
+  } while (read_retry(buffer, start));
+  *position = rebased;
+}
+
+/**
+ * @return the number of bytes held by the entries of @param buffer, read without the writer's lock
+ */
+size_t aesd_circular_buffer_snapshot_size(struct aesd_circular_buffer *buffer) {
+  unsigned int start;
+  size_t size;
+
+  do {
+    start = read_begin(buffer);
+    size = aesd_circular_buffer_size(buffer);
+  } while (read_retry(buffer, start));
+  return size;
 }
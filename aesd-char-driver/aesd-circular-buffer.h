@@ -9,6 +9,7 @@
 #define AESD_CIRCULAR_BUFFER_H
 
 #ifdef __KERNEL__
+#include <linux/seqlock.h>
 #include <linux/types.h>
 #else
 #include <stdbool.h>
@@ -29,7 +30,19 @@
 #define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Capacity used by aesd_circular_buffer_init, the number of write operations kept by default
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Entry slots stored inside struct aesd_circular_buffer, the default capacity rounded up to a power of two so it
+ * needs no allocation
+ */
+#define AESDCHAR_INLINE_ENTRIES 16
+/**
+ * Largest capacity accepted by aesd_circular_buffer_init_capacity
+ */
+#define AESDCHAR_MAX_CAPACITY (1u << 20)
 
 struct aesd_buffer_entry {
   /**
@@ -40,47 +53,171 @@ struct aesd_buffer_entry {
    * Number of bytes stored in buffptr
    */
   size_t size;
+  /**
+   * Bytes added to the circular buffer before this entry, set by aesd_circular_buffer_add_entry
+   */
+  size_t offset;
+  /**
+   * Allocation buffptr points into, for the caller to release the entry, NULL if buffptr is its own allocation
+   */
+  void *owner;
 };
 
+/**
+ * Ring of the most recent write operations.  in_offs and out_offs count writes and are never wrapped themselves;
+ * the slot of write n is entry[n & mask].  The slot array is a power of two at least as large as capacity, so
+ * indexing needs no division for any capacity.  entry may point at inline_entry, so an initialized buffer must not
+ * be copied.
+ *
+ * Entry offsets are a running prefix sum of every size ever added, so they increase from out_offs to in_offs and
+ * an fpos is found by binary search.  Subtracting evicted_bytes turns an entry offset into its fpos; the arithmetic
+ * wraps safely as long as the live entries hold less than SIZE_MAX bytes.
+ *
+ * There is a single writer, serialized by the caller, while any number of readers may use the
+ * aesd_circular_buffer_snapshot_* functions without a lock.  The writer bumps seqcount around every change and a
+ * snapshot retries until it read the ring without one in between.  Snapshots copy entries out, the memory an entry
+ * points to must stay valid until readers are done with it, which is up to the caller.
+ */
 struct aesd_circular_buffer {
   /**
    * An array of pointers to memory allocated for the most recent write operations
    */
-  struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+  struct aesd_buffer_entry *entry;
   /**
    * The current location in the entry structure where the next write should
    * be stored.
    */
-  uint8_t in_offs;
+  uint32_t in_offs;
   /**
    * The first location in the entry structure to read from
    */
-  uint8_t out_offs;
+  uint32_t out_offs;
+  /**
+   * Number of entries kept before the oldest one is overwritten
+   */
+  uint32_t capacity;
+  /**
+   * Number of slots in entry minus one
+   */
+  uint32_t mask;
   /**
    * set to true when the buffer entry structure is full
    */
   bool full;
+  /**
+   * Retention limit on the number of entries, at most capacity
+   */
+  uint32_t max_entries;
+  /**
+   * Retention limit on the bytes held by the entries, 0 for no limit
+   */
+  size_t max_bytes;
+  /**
+   * Total bytes ever added, the offset of the next entry
+   */
+  size_t written_bytes;
+  /**
+   * Total bytes of the entries overwritten so far, the offset of the oldest entry
+   */
+  size_t evicted_bytes;
+  /**
+   * Odd while the writer changes the ring, snapshots retry when it moved
+   */
+#ifdef __KERNEL__
+  seqcount_t seqcount;
+#else
+  unsigned int seqcount;
+#endif
+  /**
+   * Slots used when capacity fits in AESDCHAR_INLINE_ENTRIES
+   */
+  struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_ENTRIES];
 };
 
+/**
+ * A byte of the buffer located by a snapshot
+ */
+struct aesd_buffer_position {
+  /**
+   * The write holding the byte, counted like in_offs
+   */
+  uint32_t seq;
+  /**
+   * The byte within that write
+   */
+  size_t offset;
+  /**
+   * out_offs when the position was taken, an eviction since then shifts the fpos of every byte
+   */
+  uint32_t generation;
+};
+
+/**
+ * Called with each entry evicted by the retention policy, @param context is passed through
+ */
+typedef void (*aesd_circular_buffer_release_fn)(const struct aesd_buffer_entry *entry, void *context);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                                  size_t char_offset,
                                                                                  size_t *entry_offset_byte_rtn);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+                                                                          size_t char_offset, uint32_t *index_rtn,
+                                                                          size_t *entry_offset_byte_rtn);
+
 extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
                                                   const struct aesd_buffer_entry *add_entry);
 
+extern void aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer,
+                                                const struct aesd_buffer_entry *add_entry,
+                                                aesd_circular_buffer_release_fn release, void *context);
+
+extern int aesd_circular_buffer_set_retention(struct aesd_circular_buffer *buffer, uint32_t max_entries,
+                                              size_t max_bytes, aesd_circular_buffer_release_fn release,
+                                              void *context);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
 extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
 
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t index);
+
+extern bool aesd_circular_buffer_snapshot_fpos(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                               struct aesd_buffer_position *position);
+
+extern bool aesd_circular_buffer_snapshot_index(struct aesd_circular_buffer *buffer, uint32_t index,
+                                                struct aesd_buffer_position *position, size_t *fpos_rtn,
+                                                struct aesd_buffer_entry *entry_rtn);
+
+extern int aesd_circular_buffer_snapshot_entry(struct aesd_circular_buffer *buffer,
+                                               const struct aesd_buffer_position *position,
+                                               struct aesd_buffer_entry *entry_rtn);
+
+extern int aesd_circular_buffer_snapshot_seq(struct aesd_circular_buffer *buffer, uint32_t seq,
+                                             struct aesd_buffer_entry *entry_rtn);
+
+extern size_t aesd_circular_buffer_snapshot_size(struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_snapshot_end(struct aesd_circular_buffer *buffer,
+                                              struct aesd_buffer_position *position, size_t *fpos_rtn);
+
+extern void aesd_circular_buffer_snapshot_rebase(struct aesd_circular_buffer *buffer,
+                                                 struct aesd_buffer_position *position, size_t *fpos_rtn);
+
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each entry in the circular buffer, oldest first.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -88,7 +225,8 @@ extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index)                                                          \
-  for (index = 0, entryptr = &((buffer)->entry[index]); index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;               \
-       index++, entryptr = &((buffer)->entry[index]))
+  for (index = 0; index < aesd_circular_buffer_count(buffer) &&                                                        \
+                  ((entryptr) = &(buffer)->entry[((buffer)->out_offs + index) & (buffer)->mask], 1);                   \
+       index++)
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
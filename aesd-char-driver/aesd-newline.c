@@ -0,0 +1,105 @@
+/**
+ * @file aesd-newline.c
+ * @brief Finds every newline in a buffer at once, so framing a write of many short packets does not pay a memchr
+ * call per packet.
+ *
+ * Userspace x86 builds compare 16 (SSE2) or 32 (AVX2, picked at runtime) bytes per instruction and turn the
+ * matches into a bit mask that is walked with count trailing zeros.  The kernel cannot use vector registers
+ * without kernel_fpu_begin(), so it and other architectures fall back to memchr.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#include "aesd-newline.h"
+
+#ifndef __KERNEL__
+int aesd_newline_disable_avx2;
+#endif
+
+#if !defined(__KERNEL__) && defined(__x86_64__)
+#define AESD_NEWLINE_SIMD 1
+#include <immintrin.h>
+#include <stdint.h>
+#endif
+
+static size_t find_newlines_scalar(const char *buffer, size_t start, size_t size, size_t *positions,
+                                   size_t count, size_t max_positions) {
+  const char *newline;
+  while (count < max_positions && start < size && (newline = memchr(buffer + start, '\n', size - start)) != NULL) {
+    positions[count++] = newline - buffer;
+    start = positions[count - 1] + 1;
+  }
+  return count;
+}
+
+#ifdef AESD_NEWLINE_SIMD
+/**
+ * Appends the offsets of the bits set in @param mask, relative to @param base, to positions.
+ * @return the new count, which stops at max_positions
+ */
+static inline size_t push_mask(uint64_t mask, size_t base, size_t *positions, size_t count, size_t max_positions) {
+  while (mask != 0 && count < max_positions) {
+    positions[count++] = base + __builtin_ctzll(mask);
+    mask &= mask - 1;
+  }
+  return count;
+}
+
+// both scan 64 byte blocks, so a block without a newline costs one branch
+static size_t find_newlines_sse2(const char *buffer, size_t size, size_t *positions, size_t max_positions) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= size && count < max_positions; i += 64) {
+    __m128i m0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buffer + i)), newline);
+    __m128i m1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buffer + i + 16)), newline);
+    __m128i m2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buffer + i + 32)), newline);
+    __m128i m3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buffer + i + 48)), newline);
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3))) == 0) {
+      continue;
+    }
+    uint64_t mask = (uint64_t)_mm_movemask_epi8(m0) | (uint64_t)_mm_movemask_epi8(m1) << 16 |
+                    (uint64_t)_mm_movemask_epi8(m2) << 32 | (uint64_t)_mm_movemask_epi8(m3) << 48;
+    count = push_mask(mask, i, positions, count, max_positions);
+  }
+  if (count == max_positions) {
+    return count;
+  }
+  return find_newlines_scalar(buffer, i, size, positions, count, max_positions);
+}
+
+__attribute__((target("avx2"))) static size_t find_newlines_avx2(const char *buffer, size_t size, size_t *positions,
+                                                                 size_t max_positions) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= size && count < max_positions; i += 64) {
+    __m256i m0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buffer + i)), newline);
+    __m256i m1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buffer + i + 32)), newline);
+    if (_mm256_testz_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m0, m1))) {
+      continue;
+    }
+    uint64_t mask = (uint32_t)_mm256_movemask_epi8(m0) | (uint64_t)(uint32_t)_mm256_movemask_epi8(m1) << 32;
+    count = push_mask(mask, i, positions, count, max_positions);
+  }
+  if (count == max_positions) {
+    return count;
+  }
+  return find_newlines_scalar(buffer, i, size, positions, count, max_positions);
+}
+#endif
+
+size_t aesd_find_newlines(const char *buffer, size_t size, size_t *positions, size_t max_positions) {
+#ifdef AESD_NEWLINE_SIMD
+  if (!aesd_newline_disable_avx2 && __builtin_cpu_supports("avx2")) {
+    return find_newlines_avx2(buffer, size, positions, max_positions);
+  }
+  return find_newlines_sse2(buffer, size, positions, max_positions);
+#else
+  return find_newlines_scalar(buffer, 0, size, positions, 0, max_positions);
+#endif
+}
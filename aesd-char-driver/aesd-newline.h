@@ -0,0 +1,35 @@
+/*
+ * aesd-newline.h
+ *
+ * Newline scanning shared by the aesdchar driver, its userspace build and aesdsocket.
+ */
+
+#ifndef AESD_NEWLINE_H
+#define AESD_NEWLINE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+/**
+ * Finds the newlines in @param buffer in a single pass, vectorized with SSE2 or AVX2 when built for x86 userspace
+ * and a memchr loop otherwise.
+ * @param buffer the bytes to scan, NUL bytes are not special
+ * @param size the number of bytes in buffer
+ * @param positions receives the offset in buffer of each newline found, in increasing order
+ * @param max_positions the capacity of positions.  Scanning stops once it is full, so a caller with more newlines
+ *      than that resumes after positions[max_positions - 1]
+ * @return the number of newline offsets stored in positions
+ */
+extern size_t aesd_find_newlines(const char *buffer, size_t size, size_t *positions, size_t max_positions);
+
+#ifndef __KERNEL__
+/**
+ * Nonzero makes aesd_find_newlines use SSE2 even where AVX2 is available, so tests cover both paths
+ */
+extern int aesd_newline_disable_avx2;
+#endif
+
+#endif /* AESD_NEWLINE_H */
@@ -37,11 +37,130 @@ struct aesd_seekto {
 // https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x74
 
+/**
+ * History retention policy of an aesd char device and its current usage.  The oldest writes are dropped until both
+ * limits are met, but the newest write is always kept.
+ */
+struct aesd_retention {
+  /**
+   * Maximum number of writes kept, 0 for the capacity set by the history_size module parameter
+   */
+  uint32_t max_entries;
+  /**
+   * Number of writes currently kept, ignored by AESDCHAR_IOCSRETENTION
+   */
+  uint32_t entries;
+  /**
+   * Maximum number of bytes kept, 0 for no limit
+   */
+  uint64_t max_bytes;
+  /**
+   * Number of bytes currently kept, ignored by AESDCHAR_IOCSRETENTION
+   */
+  uint64_t bytes;
+};
+
+/**
+ * Where AESDCHAR_IOCREADENTRIES put one entry in the data buffer
+ */
+struct aesd_entry_desc {
+  /**
+   * Byte offset of the entry in the data buffer, or its stream offset for AESDCHAR_IOCGMAPHEADER
+   */
+  uint64_t offset;
+  /**
+   * Number of bytes of the entry, including its newline
+   */
+  uint64_t length;
+};
+
+/**
+ * A range of writes to copy with AESDCHAR_IOCREADENTRIES.  Entries are copied whole and back to back into data,
+ * stopping at the first one that no longer fits.
+ */
+struct aesd_read_entries {
+  /**
+   * The zero referenced write command of the first entry, like aesd_seekto.write_cmd
+   */
+  uint32_t first_cmd;
+  /**
+   * Number of entries requested, on return the number copied
+   */
+  uint32_t count;
+  /**
+   * User pointer to the buffer the entries are copied to
+   */
+  uint64_t data;
+  /**
+   * Size of data, on return the number of bytes used.  If even the first entry does not fit the ioctl fails with
+   * ENOSPC and sets it to the size of that entry.
+   */
+  uint64_t data_size;
+  /**
+   * User pointer to an array of count struct aesd_entry_desc, filled with the location of each entry copied
+   */
+  uint64_t descs;
+  /**
+   * On return the number of writes evicted when first_cmd was looked up, so the entries copied are the writes
+   * generation + first_cmd on since the device was loaded.  Commands are numbered from the oldest write kept, so
+   * first_cmd refers to the same write in a later call as long as this did not change.  Writers evicting older
+   * entries don't disturb the copy, one evicting the next entry to copy ends it early.
+   */
+  uint32_t generation;
+  uint32_t padding;
+};
+
+/**
+ * Describes the history mapped with mmap.  While mapped, the device keeps a copy of the last map_size bytes written,
+ * where the byte at stream offset o is at o % map_size.  The same pages are mapped again right after the first map_size
+ * bytes, so mapping 2 * map_size bytes lets any entry be read contiguously.
+ *
+ * Writers keep appending while a reader scans the mapping: bytes read at stream offsets from o on are valid if
+ * o >= end_offset - map_size in a header taken after reading them.
+ */
+struct aesd_map_header {
+  /**
+   * Bytes of history in the mapping, 0 if the device can't be mapped
+   */
+  uint64_t map_size;
+  /**
+   * Stream offset of the oldest entry kept, bytes before end_offset - map_size are no longer in the mapping
+   */
+  uint64_t start_offset;
+  /**
+   * Stream offset right after the newest entry
+   */
+  uint64_t end_offset;
+  /**
+   * Number of writes evicted so far, like aesd_read_entries.generation
+   */
+  uint32_t generation;
+  /**
+   * Number of entries descs has room for, on return the number of entries in the mapping, oldest first
+   */
+  uint32_t count;
+  /**
+   * User pointer to an array of count struct aesd_entry_desc, filled with the stream offset and length of the
+   * entries in the mapping, may be 0
+   */
+  uint64_t descs;
+};
+
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the retention policy, evicting right away whatever it no longer allows
+#define AESDCHAR_IOCSRETENTION _IOW(AESD_IOC_MAGIC, 2, struct aesd_retention)
+// Read back the retention policy along with the current usage
+#define AESDCHAR_IOCGRETENTION _IOR(AESD_IOC_MAGIC, 3, struct aesd_retention)
+// Copy a range of writes and their locations in one call
+#define AESDCHAR_IOCREADENTRIES _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_entries)
+// Describe the history an mmap of the device shows
+#define AESDCHAR_IOCGMAPHEADER _IOWR(AESD_IOC_MAGIC, 5, struct aesd_map_header)
+// Nonzero makes reads of this file at the end wait for the next write instead of returning end of file
+#define AESDCHAR_IOCSFOLLOW _IOW(AESD_IOC_MAGIC, 6, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
 
 #endif /* AESD_IOCTL_H */
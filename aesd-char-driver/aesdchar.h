@@ -23,14 +23,64 @@
 #define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Largest num_devices module parameter accepted
+ */
+#define AESDCHAR_MAX_DEVICES 256
+
 struct aesd_dev {
   /**
    * TODO: Add structure(s) and locks needed to complete assignment requirements
    */
   struct cdev cdev; /* Char device structure      */
+  // serializes writers, readers take snapshots of circular_buffer without it
   struct mutex lock;
   struct aesd_circular_buffer circular_buffer;
+  // packet left unterminated by a file that was closed, continued by the next write starting a packet
+  struct aesd_buffer_entry partial;
+  // holds partial when files closed with packets left unterminated concatenate them
+  struct aesd_arena arena;
+  // chunks of evicted entries, reused by the arenas of the device and its files
+  struct aesd_arena_cache cache;
+  // arena chunks are freed once the readers that may be copying from them are done
+  struct srcu_struct srcu;
+  // woken after each write that added entries, for blocking reads and poll
+  wait_queue_head_t wait;
+  // copy of the last map_size bytes of history for mmap, allocated while mapped and written under lock
+  char *map;
+  size_t map_size;
+  // mappings of map, which is freed when the last one goes so writes stop copying to it
+  unsigned int map_users;
+};
+
+/**
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file {
+  struct aesd_dev *dev;
+  /**
+   * Serializes writes to this file, which build partial without taking dev->lock
+   */
+  struct mutex write_lock;
+  /**
+   * The packet this file is writing, entries split off it point into chunks of arena
+   */
   struct aesd_buffer_entry partial;
+  struct aesd_arena arena;
+  /**
+   * Where the last read on this file stopped, which is file position cursor_pos.  It is only used while the file
+   * position is still cursor_pos, and once an eviction shifted every file position reads look the position up again.
+   */
+  struct aesd_buffer_position cursor;
+  loff_t cursor_pos;
+  bool cursor_valid;
+  /**
+   * Set by AESDCHAR_IOCSFOLLOW, reads at the end wait for the next write and evictions move the file position
+   * along with the cursor
+   */
+  bool follow;
+  // reads of one file may run concurrently now that they don't take dev->lock
+  spinlock_t cursor_lock;
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
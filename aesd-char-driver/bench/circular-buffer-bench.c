@@ -0,0 +1,119 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Compares fpos lookups and total size computation in the circular buffer: the prefix sum binary search
+ * against the linear walk the buffer used before, at 1k, 10k and 100k entries.
+ *
+ * Usage: circular-buffer-bench [-n <lookups>]
+ */
+#include "../aesd-circular-buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The lookup before offsets were tracked, walking entries from the oldest one
+static struct aesd_buffer_entry *find_linear(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                             size_t *entry_offset_byte_rtn) {
+  for (uint32_t offset = buffer->out_offs; offset != buffer->in_offs; offset++) {
+    struct aesd_buffer_entry *entry = &buffer->entry[offset & buffer->mask];
+    if (char_offset < entry->size) {
+      *entry_offset_byte_rtn = char_offset;
+      return entry;
+    }
+    char_offset -= entry->size;
+  }
+  return NULL;
+}
+
+static size_t size_linear(struct aesd_circular_buffer *buffer) {
+  size_t total = 0;
+  uint32_t index;
+  struct aesd_buffer_entry *entry;
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) { total += entry->size; }
+  return total;
+}
+
+static void run(uint32_t entries, int lookups) {
+  static char data[128];
+  struct aesd_circular_buffer buffer;
+  if (aesd_circular_buffer_init_capacity(&buffer, entries) != 0) {
+    fprintf(stderr, "Failed to create a buffer of %u entries\n", entries);
+    exit(EXIT_FAILURE);
+  }
+  // fill twice over so the oldest half has been evicted
+  for (uint32_t i = 0; i < 2 * entries; i++) {
+    struct aesd_buffer_entry entry = {.buffptr = data, .size = 1 + rand() % sizeof(data)};
+    aesd_circular_buffer_add_entry(&buffer, &entry);
+  }
+
+  size_t total = aesd_circular_buffer_size(&buffer);
+  size_t *fpos = malloc(lookups * sizeof(size_t));
+  for (int i = 0; i < lookups; i++) {
+    fpos[i] = ((size_t)rand() * RAND_MAX + rand()) % total;
+  }
+
+  size_t offset_rtn;
+  size_t checksum_linear = 0;
+  double start = now_seconds();
+  for (int i = 0; i < lookups; i++) {
+    checksum_linear += (size_t)find_linear(&buffer, fpos[i], &offset_rtn) + offset_rtn;
+  }
+  double linear = now_seconds() - start;
+
+  size_t checksum_indexed = 0;
+  start = now_seconds();
+  for (int i = 0; i < lookups; i++) {
+    checksum_indexed +=
+        (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos[i], &offset_rtn) + offset_rtn;
+  }
+  double indexed = now_seconds() - start;
+
+  volatile size_t sink = 0;
+  start = now_seconds();
+  for (int i = 0; i < lookups; i++) {
+    sink += size_linear(&buffer);
+  }
+  double size_walk = now_seconds() - start;
+  start = now_seconds();
+  for (int i = 0; i < lookups; i++) {
+    sink += aesd_circular_buffer_size(&buffer);
+  }
+  double size_indexed = now_seconds() - start;
+
+  printf("%7u entries  lookup %10.1f ns linear %8.1f ns indexed  size %10.1f ns linear %6.1f ns indexed%s\n", entries,
+         linear / lookups * 1e9, indexed / lookups * 1e9, size_walk / lookups * 1e9, size_indexed / lookups * 1e9,
+         checksum_linear == checksum_indexed ? "" : "  MISMATCH");
+  free(fpos);
+  aesd_circular_buffer_destroy(&buffer);
+}
+
+int main(int argc, char *argv[]) {
+  int lookups = 20000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n':
+      lookups = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <lookups>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (lookups <= 0) {
+    fprintf(stderr, "Lookups must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  srand(1);
+  run(1000, lookups);
+  run(10000, lookups);
+  run(100000, lookups);
+  return EXIT_SUCCESS;
+}
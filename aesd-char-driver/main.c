@@ -14,14 +14,33 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/moduleparam.h>
+#include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/shrinker.h>
 #include <linux/types.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include "aesd-arena.h"
 #include "aesd-circular-buffer.h"
+#include "aesd-newline.h"
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 // clang-format on
+// newlines framed per aesd_find_newlines call in aesd_write_iter, bounded by the kernel stack
+#define AESD_WRITE_NEWLINE_BATCH 16
+// descriptors AESDCHAR_IOCREADENTRIES copies to user space at a time
+#define AESD_READ_ENTRIES_DESC_BATCH 16
+// chunks whose references evictions under dev->lock collect to drop after unlocking
+#define AESD_RELEASE_BATCH 8
+
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
 
@@ -32,212 +51,745 @@ int aesd_minor = 0;
 MODULE_AUTHOR("Josh Heyse");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static uint history_size = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(history_size, uint, 0444);
+MODULE_PARM_DESC(history_size, "Number of writes kept by the device (default 10)");
+
+static uint map_size = 1024 * 1024;
+module_param(map_size, uint, 0444);
+MODULE_PARM_DESC(map_size, "Bytes of history mmap shows, rounded up to pages, 0 disables mmap (default 1 MiB)");
+
+static uint cache_size = 256 * 1024;
+module_param(cache_size, uint, 0444);
+MODULE_PARM_DESC(cache_size, "Bytes of freed write buffers each device keeps for reuse, 0 disables (default 256 KiB)");
+
+static uint num_devices = 1;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent aesdchar devices, minors 0 to num_devices - 1 (default 1)");
+
+// num_devices of them, each with its own lock and history
+struct aesd_dev *aesd_devices;
+
+/**
+ * Chunk references dropped by evictions, collected while dev->lock is held and put once it is released.  Entries
+ * are evicted in the order they were carved, so a run of them shares a chunk and takes a single slot.
+ */
+struct aesd_release_list {
+  struct {
+    struct aesd_arena_chunk *chunk;
+    unsigned int refs;
+  } chunks[AESD_RELEASE_BATCH];
+  size_t count;
+};
+
+/**
+ * Releases the chunk reference of an evicted entry, right away if @param context is NULL and otherwise by adding it
+ * to the struct aesd_release_list it points to.  A full list falls back to putting the reference right away.
+ */
+static void aesd_release_entry(const struct aesd_buffer_entry *entry, void *context) {
+  struct aesd_release_list *list = context;
+
+  if (list != NULL && list->count > 0 && list->chunks[list->count - 1].chunk == entry->owner) {
+    list->chunks[list->count - 1].refs++;
+  } else if (list != NULL && list->count < AESD_RELEASE_BATCH) {
+    list->chunks[list->count].chunk = entry->owner;
+    list->chunks[list->count].refs = 1;
+    list->count++;
+  } else {
+    aesd_arena_put(entry->owner);
+  }
+}
+
+/**
+ * Drops the references collected in @param list, called without dev->lock
+ */
+static void aesd_release_list_put(struct aesd_release_list *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    aesd_arena_put_many(list->chunks[i].chunk, list->chunks[i].refs);
+  }
+  list->count = 0;
+}
+
+/**
+ * Drops the partial packet of @param file, leaving any bytes in it to the device.  The next write that starts a
+ * packet continues it, so a line written with several opens, like echo -n does, still comes out as one entry.
+ */
+static void aesd_keep_partial(struct aesd_file *file) {
+  struct aesd_dev *dev = file->dev;
+
+  if (file->partial.size > 0) {
+    mutex_lock(&dev->lock);
+    if (dev->partial.size == 0) {
+      if (dev->partial.owner != NULL) {
+        aesd_arena_put(dev->partial.owner);
+      }
+      dev->partial = file->partial;
+      file->partial.owner = NULL;
+    } else {
+      char *data = aesd_arena_reserve(&dev->arena, &dev->partial, file->partial.size);
+      if (data != NULL) {
+        memcpy(data, file->partial.buffptr, file->partial.size);
+        aesd_arena_commit(&dev->arena, &dev->partial, file->partial.size);
+      } else {
+        PDEBUG("release: dropping %zu partial bytes", file->partial.size);
+      }
+    }
+    mutex_unlock(&dev->lock);
+  }
+  if (file->partial.owner != NULL) {
+    aesd_arena_put(file->partial.owner);
+  }
+  file->partial.owner = NULL;
+  file->partial.size = 0;
+}
+
+/**
+ * Makes the packet a closed file left unterminated the partial packet of @param file, which has none
+ */
+static int aesd_take_partial(struct aesd_file *file) {
+  struct aesd_dev *dev = file->dev;
+
+  if (mutex_lock_interruptible(&dev->lock)) {
+    return -ERESTARTSYS;
+  }
+  if (file->partial.owner != NULL) {
+    aesd_arena_put(file->partial.owner);
+  }
+  file->partial = dev->partial;
+  dev->partial.owner = NULL;
+  dev->partial.buffptr = NULL;
+  WRITE_ONCE(dev->partial.size, 0);
+  mutex_unlock(&dev->lock);
+  return 0;
+}
 
 int aesd_open(struct inode *inode, struct file *filp) {
-  struct aesd_dev *dev;
+  struct aesd_file *file;
   PDEBUG("open");
 
-  dev = container_of(inode->i_cdev, struct aesd_dev, cdev); // get the device structure
+  file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+  if (file == NULL) {
+    return -ENOMEM;
+  }
+  file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev); // get the device structure
+  spin_lock_init(&file->cursor_lock);
+  mutex_init(&file->write_lock);
+  aesd_arena_init(&file->arena, AESD_ARENA_CHUNK_SIZE);
+  file->arena.srcu = &file->dev->srcu;
+  file->arena.cache = &file->dev->cache;
 
-  filp->private_data = dev; // for other methods
+  filp->private_data = file; // for other methods
   return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp) {
-  struct aesd_dev *dev = filp->private_data;
+  struct aesd_file *file = filp->private_data;
 
   PDEBUG("release");
-  if (dev == NULL) {
+  if (file == NULL) {
     PDEBUG("release: no private data");
     return 0; // Should this be -EINVAL?
   }
+  aesd_keep_partial(file);
+  aesd_arena_destroy(&file->arena);
+  mutex_destroy(&file->write_lock);
+  kfree(file);
+  filp->private_data = NULL;
   return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+/**
+ * @return true if a read at @param position would return data or has to move the position first, which a reader
+ * in follow mode waits for
+ */
+static bool aesd_position_ready(struct aesd_dev *dev, const struct aesd_buffer_position *position) {
+  struct aesd_buffer_entry entry;
+  return aesd_circular_buffer_snapshot_entry(&dev->circular_buffer, position, &entry) != -ENOENT;
+}
+
+/**
+ * Copies entries to @param to starting at the position of @param iocb, continuing across entries and iovec
+ * segments until @param to is full or the buffer ends.  Sequential reads resume from the file's cursor instead of
+ * searching for the position again.  Reads don't take dev->lock: entries are copied out of snapshots of the circular
+ * buffer, and the chunks they point to are only freed once the SRCU read section ends.
+ *
+ * In follow mode (AESDCHAR_IOCSFOLLOW) a read at the end waits for the next write instead of returning 0, or fails
+ * with -EAGAIN for O_NONBLOCK files.  The reader then stays on the write it reached when older ones are evicted,
+ * and the file position moves with it.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
   ssize_t retval = 0;
-  struct aesd_dev *dev = filp->private_data;
-  struct aesd_buffer_entry *entry;
-  size_t entry_offset_byte_rtn;
+  struct file *filp = iocb->ki_filp;
+  loff_t *f_pos = &iocb->ki_pos;
+  size_t count = iov_iter_count(to);
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  struct aesd_buffer_position position;
+  bool have_position;
+  bool follow;
+  size_t copied = 0;
+  size_t fpos;
+  bool fault = false;
+  int srcu_index;
   PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
-  if (mutex_lock_interruptible(&dev->lock)) {
-    return -ERESTARTSYS;
+  if (*f_pos < 0) {
+    return 0;
   }
 
-  entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buffer, *f_pos, &entry_offset_byte_rtn);
-  if (entry == NULL) {
-    PDEBUG("read: no entry found");
-    retval = 0; // end of file
-    goto out;
-  }
+  spin_lock(&file->cursor_lock);
+  have_position = file->cursor_valid && file->cursor_pos == *f_pos;
+  position = file->cursor;
+  follow = file->follow;
+  spin_unlock(&file->cursor_lock);
 
-  ssize_t bytes_to_copy = min(entry->size - entry_offset_byte_rtn, count);
-  if (bytes_to_copy == 0) {
-    retval = 0;
-    goto out;
+  srcu_index = srcu_read_lock(&dev->srcu);
+  if (!have_position && !aesd_circular_buffer_snapshot_fpos(&dev->circular_buffer, *f_pos, &position)) {
+    if (!follow) {
+      PDEBUG("read: no entry found");
+      goto out; // end of file
+    }
+    // wait at the end, where evictions may have moved it before f_pos
+    aesd_circular_buffer_snapshot_end(&dev->circular_buffer, &position, &fpos);
+    *f_pos = fpos;
   }
+  have_position = true;
 
-  PDEBUG("read: copying %zu bytes", bytes_to_copy);
-  retval = copy_to_user(buf, entry->buffptr + entry_offset_byte_rtn, bytes_to_copy);
-  if (retval) {
-    PDEBUG("read: copy_to_user failed");
+  while (copied < count) {
+    struct aesd_buffer_entry entry;
+    int ret = aesd_circular_buffer_snapshot_entry(&dev->circular_buffer, &position, &entry);
+    if (ret == -ESTALE && copied == 0) {
+      // evictions shifted every file position since position was taken
+      if (follow) {
+        aesd_circular_buffer_snapshot_rebase(&dev->circular_buffer, &position, &fpos);
+        *f_pos = fpos;
+      } else if (!aesd_circular_buffer_snapshot_fpos(&dev->circular_buffer, *f_pos, &position)) {
+        have_position = false;
+        break;
+      }
+      continue;
+    }
+    if (ret == -ENOENT && copied == 0 && follow && count > 0) {
+      if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+        retval = -EAGAIN;
+        break;
+      }
+      // don't hold up the SRCU grace periods that free chunks while sleeping
+      srcu_read_unlock(&dev->srcu, srcu_index);
+      if (wait_event_interruptible(dev->wait, aesd_position_ready(dev, &position))) {
+        return -ERESTARTSYS;
+      }
+      srcu_index = srcu_read_lock(&dev->srcu);
+      continue;
+    }
+    if (ret) {
+      break;
+    }
+
+    size_t bytes_to_copy = min(entry.size - position.offset, count - copied);
+    PDEBUG("read: copying %zu bytes", bytes_to_copy);
+    size_t bytes_copied = copy_to_iter(entry.buffptr + position.offset, bytes_to_copy, to);
+    copied += bytes_copied;
+    position.offset += bytes_copied;
+    if (position.offset == entry.size) {
+      position.seq++;
+      position.offset = 0;
+    }
+    if (bytes_copied < bytes_to_copy) {
+      PDEBUG("read: copy_to_iter failed");
+      fault = true;
+      break;
+    }
+  }
+  if (copied == 0 && fault) {
     retval = -EFAULT;
     goto out;
   }
-  *f_pos += bytes_to_copy;
-  retval = bytes_to_copy;
+
+  *f_pos += copied;
+  if (have_position) {
+    spin_lock(&file->cursor_lock);
+    file->cursor = position;
+    file->cursor_pos = *f_pos;
+    file->cursor_valid = true;
+    spin_unlock(&file->cursor_lock);
+  }
+  if (retval == 0) {
+    retval = copied;
+  }
 
 out:
-  mutex_unlock(&dev->lock);
+  srcu_read_unlock(&dev->srcu, srcu_index);
   PDEBUG("read: returning %zd", retval);
   return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-  PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-  ssize_t retval = -ENOMEM;
-  struct aesd_dev *dev = filp->private_data;
-  // Store a pointer to the entire allocated buffer in buffer and use working as a span (pointer + size)
-  struct aesd_buffer_entry working;
-  ssize_t combined_count = dev->partial.size + count;
-  PDEBUG("write: combined count %zu", combined_count);
-  void *buffer = kmalloc(combined_count, GFP_KERNEL);
-  void *new_line_ptr = NULL;
-  working.buffptr = buffer;
-  working.size = combined_count;
-
-  if (working.buffptr == NULL) {
-    PDEBUG("write: kmalloc failed");
-    goto out;
-  }
+/**
+ * Copies @param size bytes of history at stream offset @param offset to the map of @param dev, where only the last
+ * map_size bytes fit.  dev->lock must be held.
+ */
+static void aesd_map_append(struct aesd_dev *dev, size_t offset, const char *data, size_t size) {
+  size_t start;
+  size_t first;
 
-  if (dev->partial.buffptr != NULL) {
-    memcpy((void *)working.buffptr, dev->partial.buffptr, dev->partial.size);
+  if (size > dev->map_size) {
+    data += size - dev->map_size;
+    offset += size - dev->map_size;
+    size = dev->map_size;
   }
+  start = offset % dev->map_size;
+  first = min(size, dev->map_size - start);
+  memcpy(dev->map + start, data, first);
+  memcpy(dev->map, data + first, size - first);
+}
 
-  if (copy_from_user((void *)working.buffptr + dev->partial.size, buf, count)) {
-    PDEBUG("write: copy_from_user failed");
-    goto out;
-    retval = -EFAULT;
-  }
+/**
+ * Appends the bytes of @param from to the partial packet of the file.  The bytes are copied and scanned under the
+ * file's own write_lock, so writers on different files stream packets concurrently; dev->lock is only taken to add
+ * the packets a newline completed to the circular buffer.  All iovec segments of a writev are copied into one
+ * reservation and their packets added under one dev->lock.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  size_t count = iov_iter_count(from);
+  PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
+  ssize_t retval;
+  struct aesd_file *file = iocb->ki_filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  struct aesd_buffer_entry *partial = &file->partial;
+  size_t positions[AESD_WRITE_NEWLINE_BATCH];
+  struct aesd_release_list evicted = {.count = 0};
+  size_t newline_count;
+  size_t scanned;
+  char *data;
 
-  if (dev->partial.buffptr != NULL) {
-    kfree_const(dev->partial.buffptr);
-    dev->partial.buffptr = NULL;
-    dev->partial.size = 0;
+  if (count == 0) {
+    return 0;
   }
 
-  if (mutex_lock_interruptible(&dev->lock)) {
+  if (mutex_lock_interruptible(&file->write_lock)) {
     PDEBUG("write: lock failed");
+    return -ERESTARTSYS;
+  }
+
+  if (partial->size == 0 && READ_ONCE(dev->partial.size) > 0 && aesd_take_partial(file)) {
     retval = -ERESTARTSYS;
-    goto out;
+    goto release;
   }
 
-  new_line_ptr = memchr(working.buffptr, '\n', working.size);
-  while (working.size > 0 && new_line_ptr != NULL) {
-    size_t bytes_to_copy = new_line_ptr - (void *)working.buffptr + 1;
-    struct aesd_buffer_entry *entry = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-    entry->buffptr = kmemdup(working.buffptr, bytes_to_copy, GFP_KERNEL);
-    if (entry->buffptr == NULL) {
-      PDEBUG("write: kmemdup failed");
-      retval = -EINVAL;
-      goto release;
-    }
-    entry->size = bytes_to_copy;
-    PDEBUG("write: adding entry %zu bytes", bytes_to_copy);
-    const char *garbage = aesd_circular_buffer_add_entry(&dev->circular_buffer, entry);
-    if (garbage != NULL) {
-      kfree_const(garbage);
-    }
-    working.size -= bytes_to_copy;
-    working.buffptr += bytes_to_copy;
-    new_line_ptr = memchr(working.buffptr, '\n', working.size);
+  // copy the user data once, into the arena right behind the partial packet of earlier writes
+  data = aesd_arena_reserve(&file->arena, partial, count);
+  if (data == NULL) {
+    PDEBUG("write: arena allocation failed");
+    retval = -ENOMEM;
+    goto release;
   }
+  if (copy_from_iter(data, count, from) != count) {
+    PDEBUG("write: copy_from_iter failed");
+    retval = -EFAULT;
+    goto release;
+  }
+  scanned = partial->size;
+  aesd_arena_commit(&file->arena, partial, count);
 
-  if (working.size > 0) {
-    PDEBUG("write: partial write %zu bytes", working.size);
-    dev->partial.buffptr = kmemdup(working.buffptr, working.size, GFP_KERNEL);
-    if (dev->partial.buffptr == NULL) {
-      retval = -ENOMEM;
-      goto release;
-    }
-    dev->partial.size = working.size;
+  // complete packets are split off the front of the partial packet, a batch of newlines at a time
+  newline_count = aesd_find_newlines(partial->buffptr + scanned, partial->size - scanned, positions,
+                                     AESD_WRITE_NEWLINE_BATCH);
+  if (newline_count > 0) {
+    // the bytes are committed to the packet already, so don't let a signal interrupt
+    mutex_lock(&dev->lock);
+    do {
+      size_t consumed = 0;
+      for (size_t i = 0; i < newline_count; i++) {
+        struct aesd_buffer_entry entry = {
+            .buffptr = partial->buffptr + consumed,
+            .size = scanned + positions[i] + 1 - consumed,
+            .owner = partial->owner,
+        };
+        if (consumed + entry.size == partial->size) {
+          // the last packet, like the single line most writes carry, takes over the reference of the partial packet
+          partial->owner = NULL;
+        } else {
+          aesd_arena_get(entry.owner);
+        }
+        PDEBUG("write: adding entry %zu bytes", entry.size);
+        if (dev->map != NULL) {
+          aesd_map_append(dev, dev->circular_buffer.written_bytes, entry.buffptr, entry.size);
+        }
+        aesd_circular_buffer_add_entry_evict(&dev->circular_buffer, &entry, aesd_release_entry, &evicted);
+        consumed += entry.size;
+      }
+      partial->buffptr += consumed;
+      partial->size -= consumed;
+      scanned = 0;
+    } while (partial->size > 0 && (newline_count = aesd_find_newlines(partial->buffptr, partial->size, positions,
+                                                                       AESD_WRITE_NEWLINE_BATCH)) > 0);
+    mutex_unlock(&dev->lock);
+    wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+    aesd_release_list_put(&evicted);
+  }
+
+  if (partial->size > 0) {
+    PDEBUG("write: partial write %zu bytes", partial->size);
   }
-  *f_pos += count;
+  iocb->ki_pos += count;
   retval = count;
 
 release:
-  mutex_unlock(&dev->lock);
-  PDEBUG("write: release lock");
-out:
-  if (buffer != NULL) {
-    kfree_const(buffer);
-  }
+  mutex_unlock(&file->write_lock);
   PDEBUG("write: returning %zd", retval);
   return retval;
 }
 
-static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
-  struct aesd_dev *dev = filp->private_data;
-  loff_t new_pos;
+/**
+ * Reports the device readable once a read at the file position would return data, so a reader that reached the
+ * end is woken by the next write.  Writes never block.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait) {
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  struct aesd_buffer_position position;
+  struct aesd_buffer_entry entry;
+  bool have_position;
+  __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+  loff_t pos = READ_ONCE(filp->f_pos);
+  size_t fpos;
+  int srcu_index;
 
-  PDEBUG("llseek %lld %d", offset, whence);
-  if (mutex_lock_interruptible(&dev->lock)) {
-    PDEBUG("llseek: lock failed");
-    return -ERESTARTSYS;
+  poll_wait(filp, &dev->wait, wait);
+
+  spin_lock(&file->cursor_lock);
+  have_position = file->follow && file->cursor_valid && file->cursor_pos == pos;
+  position = file->cursor;
+  spin_unlock(&file->cursor_lock);
+
+  if (!have_position) {
+    if (pos >= 0 && pos < aesd_circular_buffer_snapshot_size(&dev->circular_buffer)) {
+      mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
   }
 
-  loff_t totalSize = 0;
-  for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-    totalSize += dev->circular_buffer.entry[i].size;
+  // a follow reader stays on its write across evictions, see aesd_read_iter
+  srcu_index = srcu_read_lock(&dev->srcu);
+  if (aesd_circular_buffer_snapshot_entry(&dev->circular_buffer, &position, &entry) == -ESTALE) {
+    aesd_circular_buffer_snapshot_rebase(&dev->circular_buffer, &position, &fpos);
   }
+  if (aesd_circular_buffer_snapshot_entry(&dev->circular_buffer, &position, &entry) != -ENOENT) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  srcu_read_unlock(&dev->srcu, srcu_index);
+  return mask;
+}
+
+static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  loff_t new_pos;
+
+  PDEBUG("llseek %lld %d", offset, whence);
+  loff_t totalSize = aesd_circular_buffer_snapshot_size(&dev->circular_buffer);
 
   new_pos = fixed_size_llseek(filp, offset, whence, totalSize);
   PDEBUG("llseek %lld %d %lld -> %lld", offset, whence, totalSize, new_pos);
 
   filp->f_pos = new_pos;
-  mutex_unlock(&dev->lock);
   return new_pos;
 }
 
 static long aesd_adjust_file_offset(struct file *filp, struct aesd_seekto *seekto) {
-  struct aesd_dev *dev = filp->private_data;
-  int i;
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  struct aesd_buffer_position position;
+  struct aesd_buffer_entry entry;
+  size_t pos;
 
   PDEBUG("aesd adjust_file_offset %d %d", seekto->write_cmd, seekto->write_cmd_offset);
-  if (seekto->write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+  if (!aesd_circular_buffer_snapshot_index(&dev->circular_buffer, seekto->write_cmd, &position, &pos, &entry)) {
     PDEBUG("write_cmd %d out of range", seekto->write_cmd);
     return -EINVAL;
   }
+  if (seekto->write_cmd_offset > entry.size) {
+    PDEBUG("write_cmd_offset %d out of range", seekto->write_cmd_offset);
+    return -EINVAL;
+  }
+
+  pos += seekto->write_cmd_offset;
+  position.offset = seekto->write_cmd_offset;
+  PDEBUG("adjust_file_offset: %d %d -> %zu", seekto->write_cmd, seekto->write_cmd_offset, pos);
+
+  // the next read starts right here, no need to search for pos
+  spin_lock(&file->cursor_lock);
+  file->cursor = position;
+  file->cursor_pos = pos;
+  file->cursor_valid = true;
+  spin_unlock(&file->cursor_lock);
+  filp->f_pos = pos;
+  return 0;
+}
+
+static long aesd_set_retention(struct aesd_dev *dev, const struct aesd_retention *retention) {
+  struct aesd_release_list evicted = {.count = 0};
+  long retval;
+
+  PDEBUG("set_retention %u entries %llu bytes", retention->max_entries, retention->max_bytes);
+  if (retention->max_bytes > SIZE_MAX) {
+    return -EINVAL;
+  }
+  if (mutex_lock_interruptible(&dev->lock)) {
+    return -ERESTARTSYS;
+  }
+  retval = aesd_circular_buffer_set_retention(&dev->circular_buffer, retention->max_entries, retention->max_bytes,
+                                              aesd_release_entry, &evicted);
+  mutex_unlock(&dev->lock);
+  aesd_release_list_put(&evicted);
+  return retval;
+}
 
+static long aesd_get_retention(struct aesd_dev *dev, struct aesd_retention *retention) {
   if (mutex_lock_interruptible(&dev->lock)) {
-    PDEBUG("adjust_file_offset: lock failed");
     return -ERESTARTSYS;
   }
+  retention->max_entries = dev->circular_buffer.max_entries;
+  retention->entries = aesd_circular_buffer_count(&dev->circular_buffer);
+  retention->max_bytes = dev->circular_buffer.max_bytes;
+  retention->bytes = aesd_circular_buffer_size(&dev->circular_buffer);
+  mutex_unlock(&dev->lock);
+  return 0;
+}
+
+/**
+ * Copies the entries described by @param request to user space without dev->lock, see struct aesd_read_entries.
+ * The entries are walked by sequence number, so writers evicting older entries meanwhile don't disturb the copy,
+ * and SRCU keeps the chunks of entries evicted once copied alive.  Only a writer overtaking the copy and evicting
+ * the next entry ends it early, with the entries copied so far.
+ * @return 0 on success, -EINVAL if first_cmd is out of range, -ENOSPC if the first entry does not fit or -EFAULT
+ */
+static long aesd_read_entries(struct aesd_dev *dev, struct aesd_read_entries *request) {
+  char __user *data = u64_to_user_ptr(request->data);
+  struct aesd_entry_desc __user *descs = u64_to_user_ptr(request->descs);
+  struct aesd_entry_desc batch[AESD_READ_ENTRIES_DESC_BATCH];
+  struct aesd_buffer_position position;
+  struct aesd_buffer_entry entry;
+  size_t fpos;
+  uint32_t copied = 0;
+  uint64_t used = 0;
+  long retval = 0;
+  int srcu_index;
 
-  loff_t pos = 0;
-  for (i = 0; i < seekto->write_cmd; i++) {
-    pos +=
-        dev->circular_buffer.entry[(dev->circular_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+  PDEBUG("read_entries %u + %u", request->first_cmd, request->count);
+  srcu_index = srcu_read_lock(&dev->srcu);
+  if (!aesd_circular_buffer_snapshot_index(&dev->circular_buffer, request->first_cmd, &position, &fpos, &entry)) {
+    PDEBUG("read_entries: first_cmd %u out of range", request->first_cmd);
+    retval = -EINVAL;
+    goto out;
   }
-  if (seekto->write_cmd_offset >
-      dev->circular_buffer.entry[(dev->circular_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size) {
-    PDEBUG("write_cmd_offset %d out of range", seekto->write_cmd_offset);
-    mutex_unlock(&dev->lock);
-    return -EINVAL;
+
+  while (copied < request->count) {
+    // past the newest write, or evicted by writers that caught up with the copy
+    if (copied > 0 && aesd_circular_buffer_snapshot_seq(&dev->circular_buffer, position.seq, &entry) != 0) {
+      break;
+    }
+    if (entry.size > request->data_size - used) {
+      if (copied == 0) {
+        request->data_size = entry.size;
+        retval = -ENOSPC;
+        goto out;
+      }
+      break;
+    }
+    if (copy_to_user(data + used, entry.buffptr, entry.size)) {
+      retval = -EFAULT;
+      goto out;
+    }
+    batch[copied % AESD_READ_ENTRIES_DESC_BATCH].offset = used;
+    batch[copied % AESD_READ_ENTRIES_DESC_BATCH].length = entry.size;
+    used += entry.size;
+    copied++;
+    if (copied % AESD_READ_ENTRIES_DESC_BATCH == 0 &&
+        copy_to_user(descs + copied - AESD_READ_ENTRIES_DESC_BATCH, batch, sizeof(batch))) {
+      retval = -EFAULT;
+      goto out;
+    }
+    position.seq++;
   }
+  if (copied % AESD_READ_ENTRIES_DESC_BATCH != 0 &&
+      copy_to_user(descs + copied - copied % AESD_READ_ENTRIES_DESC_BATCH, batch,
+                   (copied % AESD_READ_ENTRIES_DESC_BATCH) * sizeof(struct aesd_entry_desc))) {
+    retval = -EFAULT;
+    goto out;
+  }
+  request->count = copied;
+  request->data_size = used;
+  request->generation = position.generation;
+
+out:
+  srcu_read_unlock(&dev->srcu, srcu_index);
+  PDEBUG("read_entries: %u entries %llu bytes, returning %ld", copied, used, retval);
+  return retval;
+}
+
+/**
+ * Takes a reference on the map of @param dev for a new mapping.  The first one allocates the map and copies the
+ * history kept so far to it.
+ * @return the map, or NULL if mmap is disabled or there is no memory
+ */
+static char *aesd_map_get(struct aesd_dev *dev) {
+  uint32_t index;
+  struct aesd_buffer_entry *entry;
+  char *map;
 
+  if (dev->map_size == 0) {
+    return NULL;
+  }
+  mutex_lock(&dev->lock);
+  if (dev->map == NULL) {
+    dev->map = vmalloc_user(dev->map_size);
+    if (dev->map != NULL) {
+      AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) {
+        aesd_map_append(dev, entry->offset, entry->buffptr, entry->size);
+      }
+    }
+  }
+  map = dev->map;
+  if (map != NULL) {
+    dev->map_users++;
+  }
   mutex_unlock(&dev->lock);
+  return map;
+}
 
-  pos += seekto->write_cmd_offset;
-  PDEBUG("adjust_file_offset: %d %d -> %lld", seekto->write_cmd, seekto->write_cmd_offset, pos);
-  filp->f_pos = pos;
+/**
+ * Drops a reference taken by aesd_map_get, the last one frees the map and writes stop copying to it
+ */
+static void aesd_map_put(struct aesd_dev *dev) {
+  char *map = NULL;
+
+  mutex_lock(&dev->lock);
+  if (--dev->map_users == 0) {
+    map = dev->map;
+    dev->map = NULL;
+  }
+  mutex_unlock(&dev->lock);
+  vfree(map);
+}
+
+// a mapping split or copied by fork counts as another user
+static void aesd_vma_open(struct vm_area_struct *vma) {
+  struct aesd_dev *dev = vma->vm_private_data;
+
+  mutex_lock(&dev->lock);
+  dev->map_users++;
+  mutex_unlock(&dev->lock);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma) { aesd_map_put(vma->vm_private_data); }
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open = aesd_vma_open,
+    .close = aesd_vma_close,
+};
+
+/**
+ * Maps the history copy of the device read only.  Offsets past map_size wrap around to the same pages, so a mapping
+ * of twice map_size shows every entry contiguously.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
+  unsigned long pages = dev->map_size >> PAGE_SHIFT;
+  unsigned long addr;
+  char *map;
+
+  PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+  if (dev->map_size == 0) {
+    return -ENODEV;
+  }
+  if (vma->vm_pgoff >= pages || (vma->vm_end - vma->vm_start) >> PAGE_SHIFT > 2 * pages - vma->vm_pgoff) {
+    return -EINVAL;
+  }
+  map = aesd_map_get(dev);
+  if (map == NULL) {
+    return -ENOMEM;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+  for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+    unsigned long page = (vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT)) % pages;
+    int err = vm_insert_page(vma, addr, vmalloc_to_page(map + (page << PAGE_SHIFT)));
+    if (err) {
+      // close is not called for a mapping that failed, and the inserted pages hold references of their own
+      aesd_map_put(dev);
+      return err;
+    }
+  }
+  // the reference taken above now belongs to the mapping, dropped by aesd_vma_close
+  vma->vm_ops = &aesd_vm_ops;
+  vma->vm_private_data = dev;
   return 0;
 }
 
+/**
+ * Fills @param header with the history the map of @param dev shows, see struct aesd_map_header.  The descriptors are
+ * collected under dev->lock and copied out after it is dropped: a fault in copy_to_user takes mmap_lock, which mmap
+ * and munmap hold while they take dev->lock.
+ */
+static long aesd_get_map_header(struct aesd_dev *dev, struct aesd_map_header *header) {
+  struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+  struct aesd_entry_desc __user *descs = u64_to_user_ptr(header->descs);
+  // the capacity of the buffer is fixed once initialized, so it bounds the entries kept
+  uint32_t capacity = header->descs != 0 ? min(header->count, buffer->capacity) : 0;
+  struct aesd_entry_desc *snapshot = NULL;
+  uint32_t count = 0;
+  uint32_t index;
+  struct aesd_buffer_entry *entry;
+  long retval = 0;
+
+  if (capacity > 0) {
+    snapshot = kvmalloc_array(capacity, sizeof(struct aesd_entry_desc), GFP_KERNEL);
+    if (snapshot == NULL) {
+      return -ENOMEM;
+    }
+  }
+  if (mutex_lock_interruptible(&dev->lock)) {
+    kvfree(snapshot);
+    return -ERESTARTSYS;
+  }
+  header->map_size = dev->map_size;
+  header->start_offset = buffer->evicted_bytes;
+  header->end_offset = buffer->written_bytes;
+  header->generation = buffer->out_offs;
+
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+    if (buffer->written_bytes - entry->offset > dev->map_size) {
+      continue; // partly overwritten by newer entries
+    }
+    if (count < capacity) {
+      snapshot[count].offset = entry->offset;
+      snapshot[count].length = entry->size;
+    }
+    count++;
+  }
+  mutex_unlock(&dev->lock);
+
+  if (count > 0 && capacity > 0 &&
+      copy_to_user(descs, snapshot, min(count, capacity) * sizeof(struct aesd_entry_desc))) {
+    retval = -EFAULT;
+  } else {
+    header->count = count;
+  }
+  kvfree(snapshot);
+  return retval;
+}
+
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  struct aesd_file *file = filp->private_data;
   PDEBUG("ioctl %d", cmd);
   if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) {
     return -ENOTTY;
@@ -253,77 +805,260 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     }
     return aesd_adjust_file_offset(filp, &seekto);
   }
+  case AESDCHAR_IOCSFOLLOW: {
+    uint32_t follow;
+    if (copy_from_user(&follow, (const void __user *)arg, sizeof(uint32_t))) {
+      return -EFAULT;
+    }
+    spin_lock(&file->cursor_lock);
+    file->follow = follow != 0;
+    spin_unlock(&file->cursor_lock);
+    return 0;
+  }
+  case AESDCHAR_IOCSRETENTION: {
+    struct aesd_retention retention;
+    if (copy_from_user(&retention, (const void __user *)arg, sizeof(struct aesd_retention))) {
+      return -EFAULT;
+    }
+    return aesd_set_retention(file->dev, &retention);
+  }
+  case AESDCHAR_IOCGRETENTION: {
+    struct aesd_retention retention;
+    long retval = aesd_get_retention(file->dev, &retention);
+    if (retval) {
+      return retval;
+    }
+    if (copy_to_user((void __user *)arg, &retention, sizeof(struct aesd_retention))) {
+      return -EFAULT;
+    }
+    return 0;
+  }
+  case AESDCHAR_IOCGMAPHEADER: {
+    struct aesd_map_header header;
+    if (copy_from_user(&header, (const void __user *)arg, sizeof(struct aesd_map_header))) {
+      return -EFAULT;
+    }
+    long retval = aesd_get_map_header(file->dev, &header);
+    if (retval) {
+      return retval;
+    }
+    if (copy_to_user((void __user *)arg, &header, sizeof(struct aesd_map_header))) {
+      return -EFAULT;
+    }
+    return 0;
+  }
+  case AESDCHAR_IOCREADENTRIES: {
+    struct aesd_read_entries request;
+    if (copy_from_user(&request, (const void __user *)arg, sizeof(struct aesd_read_entries))) {
+      return -EFAULT;
+    }
+    long retval = aesd_read_entries(file->dev, &request);
+    if (retval && retval != -ENOSPC) {
+      return retval;
+    }
+    // ENOSPC still reports the size needed
+    if (copy_to_user((void __user *)arg, &request, sizeof(struct aesd_read_entries))) {
+      return -EFAULT;
+    }
+    return retval;
+  }
   default:
     return -ENOTTY;
   }
 }
 
 struct file_operations aesd_fops = {.owner = THIS_MODULE,
-                                    .read = aesd_read,
-                                    .write = aesd_write,
+                                    .read_iter = aesd_read_iter,
+                                    .write_iter = aesd_write_iter,
                                     .open = aesd_open,
                                     .release = aesd_release,
                                     .llseek = aesd_llseek,
+                                    .poll = aesd_poll,
+                                    .mmap = aesd_mmap,
                                     .unlocked_ioctl = aesd_ioctl};
 
-static int aesd_setup_cdev(struct aesd_dev *dev) {
-  int err, devno = MKDEV(aesd_major, aesd_minor);
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index) {
+  int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
   cdev_init(&dev->cdev, &aesd_fops);
   dev->cdev.owner = THIS_MODULE;
   dev->cdev.ops = &aesd_fops;
   err = cdev_add(&dev->cdev, devno, 1);
   if (err) {
-    printk(KERN_ERR "Error %d adding aesd cdev", err);
+    printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
   }
   return err;
 }
 
+/**
+ * Initializes @param dev and makes it available as minor @param index
+ * @return 0 on success, a negative errno otherwise, in which case nothing is left to clean up
+ */
+static int aesd_init_device(struct aesd_dev *dev, unsigned int index) {
+  int result;
+
+  mutex_init(&dev->lock);
+  init_waitqueue_head(&dev->wait);
+  result = init_srcu_struct(&dev->srcu);
+  if (result) {
+    return result;
+  }
+  aesd_arena_cache_init(&dev->cache, AESD_ARENA_CHUNK_SIZE, cache_size);
+  aesd_arena_init(&dev->arena, AESD_ARENA_CHUNK_SIZE);
+  dev->arena.srcu = &dev->srcu;
+  dev->arena.cache = &dev->cache;
+  dev->map_size = PAGE_ALIGN(map_size);
+  result = aesd_circular_buffer_init_capacity(&dev->circular_buffer, history_size);
+  if (result) {
+    printk(KERN_ERR "Can't create a history of %u writes: %d\n", history_size, result);
+    cleanup_srcu_struct(&dev->srcu);
+    return result;
+  }
+
+  result = aesd_setup_cdev(dev, index);
+  if (result) {
+    aesd_circular_buffer_destroy(&dev->circular_buffer);
+    cleanup_srcu_struct(&dev->srcu);
+  }
+  return result;
+}
+
+static void aesd_cleanup_device(struct aesd_dev *dev) {
+  uint32_t index;
+  struct aesd_buffer_entry *entry;
+
+  cdev_del(&dev->cdev);
+
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) { aesd_release_entry(entry, NULL); }
+  aesd_circular_buffer_destroy(&dev->circular_buffer);
+  if (dev->partial.owner != NULL) {
+    aesd_arena_put(dev->partial.owner);
+    dev->partial.owner = NULL;
+    dev->partial.size = 0;
+  }
+  aesd_arena_destroy(&dev->arena);
+  vfree(dev->map);
+  dev->map = NULL;
+  // wait for the chunk frees queued behind the last readers
+  srcu_barrier(&dev->srcu);
+  aesd_arena_cache_destroy(&dev->cache);
+  cleanup_srcu_struct(&dev->srcu);
+  mutex_destroy(&dev->lock);
+}
+
+/**
+ * Reports the chunks the devices keep for reuse, which the shrinker frees under memory pressure
+ */
+static unsigned long aesd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+  unsigned long count = 0;
+
+  for (unsigned int index = 0; index < num_devices; index++) {
+    count += READ_ONCE(aesd_devices[index].cache.count);
+  }
+  return count;
+}
+
+static unsigned long aesd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+  unsigned long freed = 0;
+
+  for (unsigned int index = 0; index < num_devices && freed < sc->nr_to_scan; index++) {
+    freed += aesd_arena_cache_shrink(&aesd_devices[index].cache, sc->nr_to_scan - freed);
+  }
+  return freed > 0 ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *aesd_shrinker;
+
+static int aesd_register_shrinker(void) {
+  aesd_shrinker = shrinker_alloc(0, "aesdchar");
+  if (aesd_shrinker == NULL) {
+    return -ENOMEM;
+  }
+  aesd_shrinker->count_objects = aesd_shrink_count;
+  aesd_shrinker->scan_objects = aesd_shrink_scan;
+  shrinker_register(aesd_shrinker);
+  return 0;
+}
+
+static void aesd_unregister_shrinker(void) { shrinker_free(aesd_shrinker); }
+#else
+static struct shrinker aesd_shrinker = {
+    .count_objects = aesd_shrink_count,
+    .scan_objects = aesd_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static int aesd_register_shrinker(void) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+  return register_shrinker(&aesd_shrinker, "aesdchar");
+#else
+  return register_shrinker(&aesd_shrinker);
+#endif
+}
+
+static void aesd_unregister_shrinker(void) { unregister_shrinker(&aesd_shrinker); }
+#endif
+
 int aesd_init_module(void) {
   dev_t dev = 0;
+  unsigned int index;
   int result;
-  result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+
+  if (num_devices == 0 || num_devices > AESDCHAR_MAX_DEVICES) {
+    printk(KERN_ERR "num_devices must be between 1 and %u\n", AESDCHAR_MAX_DEVICES);
+    return -EINVAL;
+  }
+  result = alloc_chrdev_region(&dev, aesd_minor, num_devices, "aesdchar");
   aesd_major = MAJOR(dev);
   if (result < 0) {
     printk(KERN_WARNING "Can't get major %d\n", aesd_major);
     return result;
   }
-  PDEBUG("\n\n\naesd_init_module: major %d %s \n", aesd_major, GIT_HASH);
-  memset(&aesd_device, 0, sizeof(struct aesd_dev));
-
-  mutex_init(&aesd_device.lock);
-  aesd_circular_buffer_init(&aesd_device.circular_buffer);
-
-  result = aesd_setup_cdev(&aesd_device);
+  PDEBUG("\n\n\naesd_init_module: major %d, %u devices %s \n", aesd_major, num_devices, GIT_HASH);
 
+  aesd_devices = kcalloc(num_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+  if (aesd_devices == NULL) {
+    unregister_chrdev_region(dev, num_devices);
+    return -ENOMEM;
+  }
+  for (index = 0; index < num_devices; index++) {
+    result = aesd_init_device(&aesd_devices[index], index);
+    if (result) {
+      goto fail;
+    }
+  }
+  // the devices keep the chunks of evicted writes, give them back when memory runs low
+  result = aesd_register_shrinker();
   if (result) {
-    unregister_chrdev_region(dev, 1);
+    printk(KERN_ERR "Can't register the shrinker: %d\n", result);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  while (index-- > 0) {
+    aesd_cleanup_device(&aesd_devices[index]);
   }
+  kfree(aesd_devices);
+  aesd_devices = NULL;
+  unregister_chrdev_region(dev, num_devices);
   return result;
 }
 
 void aesd_cleanup_module(void) {
   dev_t devno = MKDEV(aesd_major, aesd_minor);
-  int index;
-  struct aesd_buffer_entry *entry;
+  unsigned int index;
 
   PDEBUG("aesd_cleanup_module\n\n\n");
-  cdev_del(&aesd_device.cdev);
-
-  AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, index) {
-    if (entry->buffptr != NULL) {
-      kfree_const(entry->buffptr);
-      entry->buffptr = NULL;
-    }
-  }
-  mutex_destroy(&aesd_device.lock);
-  if (aesd_device.partial.buffptr != NULL) {
-    kfree_const(aesd_device.partial.buffptr);
-    aesd_device.partial.buffptr = NULL;
-    aesd_device.partial.size = 0;
+  aesd_unregister_shrinker();
+  for (index = 0; index < num_devices; index++) {
+    aesd_cleanup_device(&aesd_devices[index]);
   }
+  kfree(aesd_devices);
+  aesd_devices = NULL;
 
-  unregister_chrdev_region(devno, 1);
+  unregister_chrdev_region(devno, num_devices);
 }
 
 module_init(aesd_init_module);
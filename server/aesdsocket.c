@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include "../aesd-char-driver/aesd-newline.h"
 #include "aesd_ioctl.h"
 #include "queue.h"
 #include <arpa/inet.h>
@@ -6,13 +8,20 @@
 #include <libgen.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -29,8 +38,12 @@
 // global vars are ugly
 int server_fd;
 int file_fd;
-int should_exit = 0;
+volatile sig_atomic_t should_exit = 0;
+// eventfd that becomes (and stays) readable once shutdown is requested, so blocked threads wake promptly
+int shutdown_fd = -1;
 int processing_packet = 0;
+int zero_copy = 0;
+size_t max_packet_size;
 pthread_t timer_thread;
 
 pthread_mutex_t file_lock;
@@ -42,40 +55,209 @@ const char *file_path = "/tmp/aesdsocket";
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+#define FRAMER_INITIAL_SIZE 1024
+#define FRAMER_MAX_NEWLINES 64
+#define DEFAULT_MAX_PACKET_SIZE (16 * 1024 * 1024)
+// longest prefix of a packet that is logged, multi megabyte packets would flood syslog
+#define LOG_PACKET_MAX 1024
+
+#if USE_AESD_CHAR_DEVICE == 0
+#define HISTORY_SEGMENT_SIZE (64 * 1024)
+#define HISTORY_MAX_SEGMENTS 1024
+#define HISTORY_IOV_MAX 64
+
+// marks a segment that could not be allocated, its bytes are always read back from file_fd
+#define HISTORY_SEGMENT_COLD ((char *)1)
+
+/**
+ * In memory, append only index of the data file.  Segment i caches file bytes
+ * [i * HISTORY_SEGMENT_SIZE, (i + 1) * HISTORY_SEGMENT_SIZE) and is never modified below length once written, so
+ * replies can gather straight from the segments.  Bytes past the last cached segment (or in a segment that could
+ * not be allocated) are cold and read back from file_fd.
+ *
+ * Appends take no lock: each one reserves its range by advancing reserved, writes it with pwrite, and then
+ * publishes it by advancing length once every earlier reservation has been published.  Readers snapshot length and
+ * may read anything below it without locking, since those bytes never change.
+ */
+struct history {
+  char *_Atomic segments[HISTORY_MAX_SEGMENTS];
+  atomic_size_t reserved;
+  atomic_size_t length;
+};
+
+struct history history;
+#endif
+
+enum durability {
+  DURABILITY_NONE,
+  DURABILITY_PER_PACKET,
+  DURABILITY_GROUP_COMMIT,
+};
+
+/**
+ * State shared between packet writers and the group commit flusher thread.  Every packet write takes the next
+ * write sequence number and its reply is held back until committed_seq reaches it, so a single fdatasync in
+ * flusher() acknowledges every write made during the commit window.
+ */
+struct group_commit {
+  pthread_mutex_t lock;
+  pthread_cond_t written;
+  pthread_cond_t committed;
+  uint64_t written_seq;
+  uint64_t committed_seq;
+  long window_usec;
+  // signalled after each commit so the event loop can flush replies waiting on it
+  int event_fd;
+};
+
+enum durability durability = DURABILITY_PER_PACKET;
+struct group_commit group_commit = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .written = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+    .window_usec = 1000,
+    .event_fd = -1,
+};
+pthread_t flusher_thread;
+int flusher_started = 0;
+
 struct options {
   in_port_t port;
   int daemonize;
+  int event_loop;
+  long threads;
+  int zero_copy;
+  enum durability durability;
+  long group_commit_window_usec;
+  size_t max_packet_size;
+};
+
+/**
+ * A reply waiting to be written to a client, data[pos..len) is still outstanding.
+ * When data is NULL the reply streams history bytes [pos..len) instead.
+ * A non zero commit_seq holds the reply back until the group commit covering that write completes.
+ */
+struct reply {
+  char *data;
+  size_t len;
+  size_t pos;
+  uint64_t commit_seq;
+  STAILQ_ENTRY(reply) entries;
+};
+
+enum flush_result {
+  FLUSH_ERROR = -1,
+  FLUSH_WOULD_BLOCK,
+  FLUSH_DONE,
+  FLUSH_UNCOMMITTED,
+};
+
+/**
+ * Growable receive buffer that splits a client's byte stream into newline terminated packets.  Bytes
+ * [start, end) of buf are received but not yet returned as a packet, and [start, scan) is known to hold no newline
+ * other than the ones already found in newlines, so every byte is searched once no matter how many reads a packet
+ * spans.  The buffer only grows, up to max_packet_size, or compacts when a read finds it full.
+ */
+struct framer {
+  char *buf;
+  size_t cap;
+  size_t start;
+  size_t scan;
+  size_t end;
+  // offsets in buf of newlines found by the last scan, newlines[next..count) are not framed yet
+  size_t newlines[FRAMER_MAX_NEWLINES];
+  size_t newline_count;
+  size_t newline_next;
 };
 
-typedef struct connection slist_data_t;
+/**
+ * Per client state shared by the worker pool and the event loop engines
+ */
+struct client {
+  int fd;
+  struct sockaddr_in addr;
+  char ip_address[16];
+  struct framer framer;
+  STAILQ_HEAD(replies_t, reply) replies;
+  // event loop clients with a reply waiting on a group commit
+  LIST_ENTRY(client) uncommitted;
+  int is_uncommitted;
+  // event loop clients closed while handling a batch of events, freed once the batch is done
+  LIST_ENTRY(client) closed;
+};
+
+/**
+ * An accepted socket waiting for a worker thread
+ */
 struct connection {
   int fd;
   struct sockaddr_in addr;
-  pthread_t thread_id;
-  int thread_complete;
-  SLIST_ENTRY(connection) entries;
 };
 
-pthread_mutex_t connections_lock;
-SLIST_HEAD(connections_t, connection) connections;
+#define CONNECTION_QUEUE_SIZE 64
+
+/**
+ * Bounded multi producer, multi consumer queue of accepted connections feeding the worker pool.
+ * The accept loop blocks in connection_queue_push while the queue is full, which pushes back on clients
+ * through the listen backlog instead of accepting work no worker can pick up.
+ */
+struct connection_queue {
+  struct connection connections[CONNECTION_QUEUE_SIZE];
+  size_t head;
+  size_t count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+struct connection_queue connection_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+pthread_t *worker_threads;
+long worker_thread_count;
 
 void printUsage(char *argv[]);
 void parseArgs(int argc, char *argv[], struct options *options);
 void cleanUpAndExit(int status);
 int write_buffer(int fd, char *buffer, int buffer_len);
-void *handle_client_connection(void *arg);
+ssize_t framer_read(struct framer *framer, int fd);
+size_t framer_next(struct framer *framer, char **packet);
+#if USE_AESD_CHAR_DEVICE == 0
+int history_append(const char *buffer, size_t buffer_len);
+ssize_t send_history(int fd, size_t pos, size_t end);
+#endif
+void init_client(struct client *client, int fd, struct sockaddr_in *addr);
+void free_client_replies(struct client *client);
+void free_client(struct client *client);
+int queue_file_reply(struct client *client, uint64_t commit_seq);
+int queue_reply(struct client *client, uint64_t commit_seq);
+uint64_t sync_file(void);
+int wait_for_commit(uint64_t commit_seq);
+void *flusher(void *arg);
+int process_input(struct client *client);
+enum flush_result flush_replies(struct client *client);
+int wait_for_client(int fd, short events);
+int connection_queue_push(struct connection_queue *queue, const struct connection *conn);
+int connection_queue_pop(struct connection_queue *queue, struct connection *conn);
+void handle_client_connection(struct connection *conn);
+void *worker(void *arg);
+void run_event_loop(int server_fd);
 void deamonize(char *base_name);
-void mark_all_threads_complete(struct connections_t *connections);
-void collect_complete_threads(struct connections_t *connections);
+void join_worker_threads(void);
 
 void printUsage(char *argv[]) {
-  fprintf(stderr, "Usage: %s -d -p <port>\n", argv[0]);
+  fprintf(stderr,
+          "Usage: %s [-d] [-e] [-z] [-p <port>] [-t <threads>] [-s none|per-packet|group-commit] [-w <usec>]\n"
+          "          [-m <max packet bytes>]\n",
+          argv[0]);
   exit(EXIT_FAILURE);
 }
 
 void parseArgs(int argc, char *argv[], struct options *options) {
   int opt = -1;
-  while ((opt = getopt(argc, argv, "dp:")) != -1) {
+  while ((opt = getopt(argc, argv, "dezp:t:s:w:m:")) != -1) {
     switch (opt) {
     case 'p':
       options->port = (in_port_t)strtol(optarg, NULL, 10);
@@ -83,6 +265,47 @@ void parseArgs(int argc, char *argv[], struct options *options) {
     case 'd':
       options->daemonize = 1;
       break;
+    case 'e':
+      options->event_loop = 1;
+      break;
+    case 'z':
+#if USE_AESD_CHAR_DEVICE
+      // replies are read from the char device, there is no data file to sendfile from
+      fprintf(stderr, "-z is only supported when built with USE_AESD_CHAR_DEVICE=0\n");
+      exit(EXIT_FAILURE);
+#else
+      options->zero_copy = 1;
+      break;
+#endif
+    case 's':
+      if (strcmp(optarg, "none") == 0) {
+        options->durability = DURABILITY_NONE;
+      } else if (strcmp(optarg, "per-packet") == 0) {
+        options->durability = DURABILITY_PER_PACKET;
+      } else if (strcmp(optarg, "group-commit") == 0) {
+        options->durability = DURABILITY_GROUP_COMMIT;
+      } else {
+        printUsage(argv);
+      }
+      break;
+    case 'w':
+      options->group_commit_window_usec = strtol(optarg, NULL, 10);
+      if (options->group_commit_window_usec < 0) {
+        printUsage(argv);
+      }
+      break;
+    case 'm':
+      options->max_packet_size = strtoul(optarg, NULL, 10);
+      if (options->max_packet_size == 0) {
+        printUsage(argv);
+      }
+      break;
+    case 't':
+      options->threads = strtol(optarg, NULL, 10);
+      if (options->threads <= 0) {
+        printUsage(argv);
+      }
+      break;
     case '?':
     case 'h':
       fprintf(stderr, "Unknow option or missing argument: %c %c\n", opt, optopt);
@@ -96,6 +319,22 @@ void parseArgs(int argc, char *argv[], struct options *options) {
 void cleanUpAndExit(int status) {
   syslog(LOG_INFO, "Exiting with status %d", status);
 
+  should_exit = 1;
+  if (shutdown_fd >= 0) {
+    uint64_t one = 1;
+    write(shutdown_fd, &one, sizeof(one));
+  }
+  pthread_mutex_lock(&group_commit.lock);
+  pthread_cond_broadcast(&group_commit.written);
+  pthread_cond_broadcast(&group_commit.committed);
+  pthread_mutex_unlock(&group_commit.lock);
+  join_worker_threads();
+  if (flusher_started && !pthread_equal(flusher_thread, pthread_self())) {
+    pthread_join(flusher_thread, NULL);
+  }
+
+  pthread_cancel(timer_thread);
+
   if (server_fd > 0) {
     close(server_fd);
     server_fd = -1;
@@ -107,18 +346,15 @@ void cleanUpAndExit(int status) {
     file_fd = -1;
   }
 
-  should_exit = 1;
-  collect_complete_threads(&connections);
-
-  pthread_cancel(timer_thread);
-
   closelog();
   exit(status);
 }
 
 void signal_handler(int signal) {
-  syslog(LOG_INFO, "Caught signal, exiting");
-  cleanUpAndExit(EXIT_SUCCESS);
+  // only async-signal-safe work here, the main thread logs and cleans up once it wakes on shutdown_fd
+  should_exit = 1;
+  uint64_t one = 1;
+  write(shutdown_fd, &one, sizeof(one));
 }
 
 int write_buffer(int fd, char *buffer, int buffer_len) {
@@ -133,95 +369,721 @@ int write_buffer(int fd, char *buffer, int buffer_len) {
   return 1;
 }
 
-void *handle_client_connection(void *arg) {
-  struct connection *conn = (struct connection *)arg;
-  char ip_address[16];
-  char in_buffer[1024];
-  int in_buffer_len = sizeof(in_buffer) - 1;
+/**
+ * Reads from @param fd into the free space at the end of @param framer.  A full buffer is compacted when that frees
+ * at least as many bytes as it moves and grown otherwise, so the bytes of a partial packet are copied an amortized
+ * constant number of times.
+ * @return the result of read(2), or -1 with errno set to EMSGSIZE once a packet exceeds max_packet_size
+ */
+ssize_t framer_read(struct framer *framer, int fd) {
+  if (framer->end == framer->cap) {
+    size_t partial = framer->end - framer->start;
+    if (framer->start > 0 && (framer->start >= partial || framer->cap == max_packet_size)) {
+      memmove(framer->buf, framer->buf + framer->start, partial);
+      framer->scan -= framer->start;
+      framer->end = partial;
+      framer->start = 0;
+    } else if (framer->cap < max_packet_size) {
+      size_t cap = framer->cap == 0 ? FRAMER_INITIAL_SIZE : framer->cap * 2;
+      cap = MIN(cap, max_packet_size);
+      char *buf = realloc(framer->buf, cap);
+      if (buf == NULL) {
+        return -1;
+      }
+      framer->buf = buf;
+      framer->cap = cap;
+    } else {
+      errno = EMSGSIZE;
+      return -1;
+    }
+  }
+  return read(fd, framer->buf + framer->end, framer->cap - framer->end);
+}
 
-  char out_buffer[1024];
-  memset(in_buffer, 0, sizeof(in_buffer));
-  memset(out_buffer, 0, sizeof(out_buffer));
+/**
+ * Frames the next complete packet received by @param framer and points @param packet at it.  Newlines are found
+ * up to FRAMER_MAX_NEWLINES at a time with aesd_find_newlines, so a read holding many short packets is scanned in
+ * one pass.  The packet stays valid until the next framer_read, callers frame every packet before reading again.
+ * @return the packet length including its newline, or 0 if no complete packet is buffered
+ */
+size_t framer_next(struct framer *framer, char **packet) {
+  if (framer->newline_next == framer->newline_count) {
+    size_t count = aesd_find_newlines(framer->buf + framer->scan, framer->end - framer->scan, framer->newlines,
+                                      FRAMER_MAX_NEWLINES);
+    for (size_t i = 0; i < count; i++) {
+      framer->newlines[i] += framer->scan;
+    }
+    framer->newline_count = count;
+    framer->newline_next = 0;
+    framer->scan = count == FRAMER_MAX_NEWLINES ? framer->newlines[count - 1] + 1 : framer->end;
+  }
+  if (framer->newline_next == framer->newline_count) {
+    if (framer->start == framer->end) {
+      // nothing partial is left, so the next read can start at the front without a compaction
+      framer->start = framer->scan = framer->end = 0;
+    }
+    return 0;
+  }
+  size_t length = framer->newlines[framer->newline_next++] + 1 - framer->start;
+  *packet = framer->buf + framer->start;
+  framer->start += length;
+  return length;
+}
 
-  inet_ntop(AF_INET, &conn->addr.sin_addr, ip_address, sizeof(ip_address));
-  syslog(LOG_INFO, "Accepted connection from %s", ip_address);
+void init_client(struct client *client, int fd, struct sockaddr_in *addr) {
+  client->fd = fd;
+  client->addr = *addr;
+  memset(&client->framer, 0, sizeof(client->framer));
+  STAILQ_INIT(&client->replies);
+  client->is_uncommitted = 0;
+  inet_ntop(AF_INET, &client->addr.sin_addr, client->ip_address, sizeof(client->ip_address));
+}
 
-  int flags = fcntl(conn->fd, F_GETFL, 0);
-  fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+void free_client_replies(struct client *client) {
+  struct reply *reply;
+  while ((reply = STAILQ_FIRST(&client->replies)) != NULL) {
+    STAILQ_REMOVE_HEAD(&client->replies, entries);
+    free(reply->data);
+    free(reply);
+  }
+}
 
-  ssize_t in_bytes_read = -1;
-  while (!should_exit && (in_bytes_read = read(conn->fd, in_buffer, in_buffer_len)) != 0) {
-    if (in_bytes_read == -1) {
-      int res = errno;
-      if (res == EAGAIN || res == EWOULDBLOCK) {
-        usleep(1000000);
+void free_client(struct client *client) {
+  free_client_replies(client);
+  free(client->framer.buf);
+}
+
+#if USE_AESD_CHAR_DEVICE == 0
+/**
+ * @return the cached segment holding history byte @param pos, allocating it on first use, or NULL if the byte is cold
+ */
+static char *history_segment(size_t pos) {
+  size_t index = pos / HISTORY_SEGMENT_SIZE;
+  if (index >= HISTORY_MAX_SEGMENTS) {
+    return NULL;
+  }
+  char *segment = atomic_load_explicit(&history.segments[index], memory_order_acquire);
+  if (segment == NULL) {
+    char *allocated = malloc(HISTORY_SEGMENT_SIZE);
+    char *expected = NULL;
+    // a failed allocation marks the segment cold for good, a later one would leave holes in it
+    if (atomic_compare_exchange_strong(&history.segments[index], &expected,
+                                       allocated != NULL ? allocated : HISTORY_SEGMENT_COLD)) {
+      segment = allocated != NULL ? allocated : HISTORY_SEGMENT_COLD;
+    } else {
+      free(allocated);
+      segment = expected;
+    }
+  }
+  return segment != HISTORY_SEGMENT_COLD ? segment : NULL;
+}
+
+/**
+ * Appends @param buffer to the end of the data file and the history index.  Safe to call concurrently without
+ * file_lock; appends become visible to readers in the order their ranges were reserved.  Zero copy replies (-z)
+ * never read the cached segments, so they are only filled without it.
+ * @return 1 on success, 0 if the file write failed
+ */
+int history_append(const char *buffer, size_t buffer_len) {
+  int result = 1;
+  size_t offset = atomic_fetch_add(&history.reserved, buffer_len);
+
+  size_t written = 0;
+  while (written < buffer_len) {
+    ssize_t ret = pwrite(file_fd, buffer + written, buffer_len - written, offset + written);
+    if (ret < 0) {
+      if (errno == EINTR) {
         continue;
       }
+      // the range is still published below, later appends wait for it
+      result = 0;
+      break;
+    }
+    written += ret;
+  }
+
+  size_t pos = zero_copy ? offset + buffer_len : offset;
+  while (pos < offset + buffer_len) {
+    size_t len = MIN(HISTORY_SEGMENT_SIZE - pos % HISTORY_SEGMENT_SIZE, offset + buffer_len - pos);
+    char *segment = history_segment(pos);
+    if (segment != NULL) {
+      memcpy(segment + pos % HISTORY_SEGMENT_SIZE, buffer + (pos - offset), len);
+    }
+    pos += len;
+  }
+
+  while (atomic_load_explicit(&history.length, memory_order_acquire) != offset) {
+    sched_yield();
+  }
+  atomic_store_explicit(&history.length, offset + buffer_len, memory_order_release);
+  return result;
+}
+
+/**
+ * Writes history bytes [@param pos, @param end) to @param fd, gathering cached segments with writev and reading
+ * cold bytes back from file_fd.  In zero copy mode (-z) the bytes are sent straight from file_fd with sendfile
+ * instead.  May write less than requested, like write(2).
+ * @return the number of bytes written, or -1 with errno set
+ */
+ssize_t send_history(int fd, size_t pos, size_t end) {
+  struct iovec iov[HISTORY_IOV_MAX];
+  int iovcnt = 0;
+
+  if (zero_copy) {
+    off_t offset = pos;
+    return sendfile(fd, file_fd, &offset, end - pos);
+  }
+
+  while (pos < end && iovcnt < HISTORY_IOV_MAX) {
+    size_t index = pos / HISTORY_SEGMENT_SIZE;
+    size_t offset = pos % HISTORY_SEGMENT_SIZE;
+    char *segment = index < HISTORY_MAX_SEGMENTS ? atomic_load_explicit(&history.segments[index], memory_order_acquire)
+                                                 : NULL;
+    if (segment == NULL || segment == HISTORY_SEGMENT_COLD) {
+      break;
+    }
+    iov[iovcnt].iov_base = segment + offset;
+    iov[iovcnt].iov_len = MIN(HISTORY_SEGMENT_SIZE - offset, end - pos);
+    pos += iov[iovcnt].iov_len;
+    iovcnt++;
+  }
+  if (iovcnt > 0) {
+    return writev(fd, iov, iovcnt);
+  }
+
+  char out_buffer[16 * 1024];
+  ssize_t file_bytes_read = pread(file_fd, out_buffer, MIN(sizeof(out_buffer), end - pos), pos);
+  if (file_bytes_read <= 0) {
+    if (file_bytes_read == 0) {
+      errno = EIO;
     }
+    return -1;
+  }
+  return write(fd, out_buffer, file_bytes_read);
+}
+#endif
 
-    { // start file_lock
-      if (pthread_mutex_lock(&file_lock)) {
-        syslog(LOG_ERR, "Failed to lock file: %s", strerror(errno));
-        cleanUpAndExit(EXIT_FAILURE);
+/**
+ * Reads file_fd from its current position to EOF and queues the content as a reply for @param client.
+ * Caller must hold file_lock.
+ * @return 1 on success, 0 if the reply could not be allocated
+ */
+int queue_file_reply(struct client *client, uint64_t commit_seq) {
+  struct reply *reply = calloc(1, sizeof(struct reply));
+  if (reply == NULL) {
+    return 0;
+  }
+  reply->commit_seq = commit_seq;
+
+  size_t capacity = 1024;
+  reply->data = malloc(capacity);
+  ssize_t file_bytes_read = 0;
+  while (reply->data != NULL &&
+         (file_bytes_read = read(file_fd, reply->data + reply->len, capacity - reply->len)) > 0) {
+    reply->len += file_bytes_read;
+    if (reply->len == capacity) {
+      capacity *= 2;
+      char *data = realloc(reply->data, capacity);
+      if (data == NULL) {
+        free(reply->data);
       }
+      reply->data = data;
+    }
+  }
+  if (reply->data == NULL) {
+    free(reply);
+    return 0;
+  }
 
-      in_buffer[in_bytes_read] = '\0';
-
-      /* lseek(file_fd, 0, SEEK_END); */
-
-      char *newline_char = in_buffer;
-      char *prev_newline_char = in_buffer;
-
-      while ((newline_char = strchr(prev_newline_char, '\n')) != NULL) {
-        int length = newline_char - prev_newline_char + 1;
-        syslog(LOG_INFO, "Received %*.*s", length, length, prev_newline_char);
-        struct aesd_seekto seekto;
-        if (strncmp(prev_newline_char, "AESDCHAR_IOCSEEKTO", MIN(length, 18)) == 0) {
-          if (sscanf(prev_newline_char, "AESDCHAR_IOCSEEKTO:%d,%d", &seekto.write_cmd, &seekto.write_cmd_offset) == 2) {
-            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
-              syslog(LOG_ERR, "Failed to seek to %d %d", seekto.write_cmd, seekto.write_cmd_offset);
-              pthread_mutex_unlock(&file_lock);
-              close(conn->fd);
-              conn->thread_complete = 1;
-              return NULL;
-            }
+  STAILQ_INSERT_TAIL(&client->replies, reply, entries);
+  return 1;
+}
+
+/**
+ * Queues the full content of the data file as a reply for @param client.  The char device is read back into
+ * memory, since its content depends on the shared file position, while the data file is sent from the history
+ * index when the reply is flushed.  Caller must hold file_lock for the char device.
+ * @return 1 on success, 0 if the reply could not be allocated
+ */
+int queue_reply(struct client *client, uint64_t commit_seq) {
+#if USE_AESD_CHAR_DEVICE
+  return queue_file_reply(client, commit_seq);
+#else
+  struct reply *reply = calloc(1, sizeof(struct reply));
+  if (reply == NULL) {
+    return 0;
+  }
+  reply->len = atomic_load_explicit(&history.length, memory_order_acquire);
+  reply->commit_seq = commit_seq;
+  STAILQ_INSERT_TAIL(&client->replies, reply, entries);
+  return 1;
+#endif
+}
+
+/**
+ * Applies the durability policy after a packet was written to file_fd.
+ * @return the group commit sequence number the reply has to wait for, or 0 if it can be sent right away
+ */
+uint64_t sync_file(void) {
+  uint64_t commit_seq = 0;
+  switch (durability) {
+  case DURABILITY_NONE:
+    break;
+  case DURABILITY_PER_PACKET:
+    fdatasync(file_fd);
+    break;
+  case DURABILITY_GROUP_COMMIT:
+    pthread_mutex_lock(&group_commit.lock);
+    commit_seq = ++group_commit.written_seq;
+    pthread_cond_signal(&group_commit.written);
+    pthread_mutex_unlock(&group_commit.lock);
+    break;
+  }
+  return commit_seq;
+}
+
+/**
+ * Blocks until the write numbered @param commit_seq has been committed.
+ * @return 1 once committed, 0 on shutdown
+ */
+int wait_for_commit(uint64_t commit_seq) {
+  pthread_mutex_lock(&group_commit.lock);
+  while (group_commit.committed_seq < commit_seq && !should_exit) {
+    pthread_cond_wait(&group_commit.committed, &group_commit.lock);
+  }
+  int committed = group_commit.committed_seq >= commit_seq;
+  pthread_mutex_unlock(&group_commit.lock);
+  return committed;
+}
+
+/**
+ * Group commit flusher.  Once a write is pending it waits out the commit window so that writes from other clients
+ * can join, then covers all of them with one fdatasync outside file_lock.  A write only gets its sequence number
+ * after it reached file_fd, so every sequence number up to the one sampled before the sync is durable after it.
+ */
+void *flusher(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&group_commit.lock);
+    while (group_commit.written_seq == group_commit.committed_seq && !should_exit) {
+      pthread_cond_wait(&group_commit.written, &group_commit.lock);
+    }
+    pthread_mutex_unlock(&group_commit.lock);
+    if (should_exit) {
+      break;
+    }
+
+    if (group_commit.window_usec > 0) {
+      usleep(group_commit.window_usec);
+    }
+
+    pthread_mutex_lock(&group_commit.lock);
+    uint64_t commit_seq = group_commit.written_seq;
+    pthread_mutex_unlock(&group_commit.lock);
+
+    fdatasync(file_fd);
+
+    pthread_mutex_lock(&group_commit.lock);
+    group_commit.committed_seq = commit_seq;
+    pthread_cond_broadcast(&group_commit.committed);
+    pthread_mutex_unlock(&group_commit.lock);
+
+    uint64_t one = 1;
+    write(group_commit.event_fd, &one, sizeof(one));
+  }
+  return NULL;
+}
+
+/**
+ * Handles every complete packet buffered in client->framer, queueing one reply per packet.  The char device is
+ * driven through the shared file position and serialized by file_lock; the data file history is appended and read
+ * without it.
+ * @return 1 on success, 0 if the connection should be closed
+ */
+int process_input(struct client *client) {
+  int result = 1;
+  char *packet;
+  size_t length;
+
+  { // start file_lock
+#if USE_AESD_CHAR_DEVICE
+    if (pthread_mutex_lock(&file_lock)) {
+      syslog(LOG_ERR, "Failed to lock file: %s", strerror(errno));
+      cleanUpAndExit(EXIT_FAILURE);
+    }
+#endif
+
+    while ((length = framer_next(&client->framer, &packet)) > 0) {
+      int logged = MIN(length, LOG_PACKET_MAX);
+      syslog(LOG_INFO, "Received %*.*s", logged, logged, packet);
+      struct aesd_seekto seekto;
+      uint64_t commit_seq = 0;
+      char command[64];
+      if (length < sizeof(command) && strncmp(packet, "AESDCHAR_IOCSEEKTO", MIN(length, 18)) == 0) {
+        // packets are not NUL terminated, sscanf needs a copy that is
+        memcpy(command, packet, length);
+        command[length] = '\0';
+        if (sscanf(command, "AESDCHAR_IOCSEEKTO:%d,%d", &seekto.write_cmd, &seekto.write_cmd_offset) == 2) {
+          if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+            syslog(LOG_ERR, "Failed to seek to %d %d", seekto.write_cmd, seekto.write_cmd_offset);
+            result = 0;
+            break;
           }
-        } else {
-          write_buffer(file_fd, prev_newline_char, length);
-          fdatasync(file_fd);
-          lseek(file_fd, 0, SEEK_SET);
         }
+      } else {
+#if USE_AESD_CHAR_DEVICE
+        write_buffer(file_fd, packet, length);
+        commit_seq = sync_file();
+        lseek(file_fd, 0, SEEK_SET);
+#else
+        if (!history_append(packet, length)) {
+          syslog(LOG_ERR, "Failed to write to file: %s", strerror(errno));
+        }
+        commit_seq = sync_file();
+#endif
+      }
 
-        ssize_t file_bytes_read = 0;
-        while ((file_bytes_read = read(file_fd, out_buffer, sizeof(out_buffer))) > 0) {
-          if (!write_buffer(conn->fd, out_buffer, file_bytes_read)) {
-            syslog(LOG_ERR, "Failed to write to socket");
-            close(conn->fd);
-            conn->thread_complete = 1;
-            return NULL;
-          }
+      if (!queue_reply(client, commit_seq)) {
+        syslog(LOG_ERR, "Failed to allocate reply");
+        result = 0;
+        break;
+      }
+    }
+
+#if USE_AESD_CHAR_DEVICE
+    if (pthread_mutex_unlock(&file_lock)) {
+      syslog(LOG_ERR, "Failed to unlock file: %s", strerror(errno));
+      cleanUpAndExit(EXIT_FAILURE);
+    }
+#endif
+  } // end file_lock
+
+  return result;
+}
+
+/**
+ * Writes queued replies to the client socket until they are all sent, the socket would block or the next reply
+ * waits for a group commit.
+ */
+enum flush_result flush_replies(struct client *client) {
+  struct reply *reply;
+  while ((reply = STAILQ_FIRST(&client->replies)) != NULL) {
+    if (reply->commit_seq > 0) {
+      pthread_mutex_lock(&group_commit.lock);
+      int committed = group_commit.committed_seq >= reply->commit_seq;
+      pthread_mutex_unlock(&group_commit.lock);
+      if (!committed) {
+        return FLUSH_UNCOMMITTED;
+      }
+      reply->commit_seq = 0;
+    }
+    while (reply->pos < reply->len) {
+      ssize_t ret;
+#if USE_AESD_CHAR_DEVICE == 0
+      if (reply->data == NULL) {
+        ret = send_history(client->fd, reply->pos, reply->len);
+      } else
+#endif
+        ret = write(client->fd, reply->data + reply->pos, reply->len - reply->pos);
+      if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return FLUSH_WOULD_BLOCK;
+        }
+        if (errno == EINTR) {
+          continue;
         }
-        prev_newline_char = newline_char + 1;
+        return FLUSH_ERROR;
       }
+      reply->pos += ret;
+    }
+    STAILQ_REMOVE_HEAD(&client->replies, entries);
+    free(reply->data);
+    free(reply);
+  }
+  return FLUSH_DONE;
+}
+
+/**
+ * Blocks until @param fd is ready for @param events or shutdown is requested.
+ * @return 1 when fd is ready, 0 on shutdown, -1 on error
+ */
+int wait_for_client(int fd, short events) {
+  struct pollfd pfds[2] = {
+      {.fd = fd, .events = events},
+      {.fd = shutdown_fd, .events = POLLIN},
+  };
+  while (poll(pfds, 2, -1) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  if (pfds[1].revents & POLLIN) {
+    return 0;
+  }
+  return 1;
+}
+
+int connection_queue_push(struct connection_queue *queue, const struct connection *conn) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == CONNECTION_QUEUE_SIZE && !should_exit) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  if (should_exit) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+  queue->connections[(queue->head + queue->count) % CONNECTION_QUEUE_SIZE] = *conn;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
 
-      /* lseek(file_fd, 0, SEEK_END); */
-      /* write_buffer(file_fd, prev_newline_char, in_bytes_read - (prev_newline_char - in_buffer)); */
+/**
+ * Blocks until a connection is available and copies it to @param conn.
+ * @return 1 when a connection was dequeued, 0 on shutdown
+ */
+int connection_queue_pop(struct connection_queue *queue, struct connection *conn) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !should_exit) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (should_exit) {
+    // the signal handler cannot wake an accept loop blocked on a full queue, so the workers do
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+  *conn = queue->connections[queue->head];
+  queue->head = (queue->head + 1) % CONNECTION_QUEUE_SIZE;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
 
-      if (pthread_mutex_unlock(&file_lock)) {
-        syslog(LOG_ERR, "Failed to unlock file: %s", strerror(errno));
-        cleanUpAndExit(EXIT_FAILURE);
+void *worker(void *arg) {
+  struct connection conn;
+  while (connection_queue_pop(&connection_queue, &conn)) {
+    handle_client_connection(&conn);
+  }
+  return NULL;
+}
+
+void handle_client_connection(struct connection *conn) {
+  struct client client;
+
+  init_client(&client, conn->fd, &conn->addr);
+  syslog(LOG_INFO, "Accepted connection from %s", client.ip_address);
+
+  int flags = fcntl(conn->fd, F_GETFL, 0);
+  fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+
+  ssize_t in_bytes_read = -1;
+  while (wait_for_client(conn->fd, POLLIN) > 0 &&
+         (in_bytes_read = framer_read(&client.framer, conn->fd)) != 0) {
+    if (in_bytes_read == -1) {
+      int res = errno;
+      if (res == EAGAIN || res == EWOULDBLOCK || res == EINTR) {
+        continue;
       }
-    } // end file_lock
+      break;
+    }
+
+    client.framer.end += in_bytes_read;
+    if (!process_input(&client)) {
+      break;
+    }
+
+    enum flush_result flushed;
+    while ((flushed = flush_replies(&client)) != FLUSH_DONE && flushed != FLUSH_ERROR) {
+      int ready = flushed == FLUSH_UNCOMMITTED ? wait_for_commit(STAILQ_FIRST(&client.replies)->commit_seq)
+                                               : wait_for_client(conn->fd, POLLOUT);
+      if (ready <= 0) {
+        flushed = FLUSH_ERROR;
+        break;
+      }
+    }
+    if (flushed == FLUSH_ERROR) {
+      syslog(LOG_ERR, "Failed to write to socket");
+      break;
+    }
   }
 
   if (in_bytes_read < 0) {
-    syslog(LOG_ERR, "Failed to read from socket");
+    syslog(LOG_ERR, "Failed to read from socket: %s", strerror(errno));
   }
-  syslog(LOG_INFO, "Connection closed from %s", ip_address);
+  syslog(LOG_INFO, "Connection closed from %s", client.ip_address);
 
+  free_client(&client);
   close(conn->fd);
-  conn->thread_complete = 1;
-  return NULL;
+}
+
+LIST_HEAD(uncommitted_clients_t, client) uncommitted_clients = LIST_HEAD_INITIALIZER(uncommitted_clients);
+LIST_HEAD(closed_clients_t, client) closed_clients = LIST_HEAD_INITIALIZER(closed_clients);
+
+/**
+ * Closes an event loop client.  Closing the fd also removes it from the epoll set, but events already returned
+ * by epoll_wait may still point at the client: a group commit can close a parked client that also has a hangup
+ * later in the same batch.  So the client is only marked closed with an fd of -1, and freed by
+ * free_closed_clients once the batch is done.
+ */
+static void close_event_client(struct client *client) {
+  syslog(LOG_INFO, "Connection closed from %s", client->ip_address);
+  if (client->is_uncommitted) {
+    LIST_REMOVE(client, uncommitted);
+    client->is_uncommitted = 0;
+  }
+  free_client(client);
+  close(client->fd);
+  client->fd = -1;
+  LIST_INSERT_HEAD(&closed_clients, client, closed);
+}
+
+static void free_closed_clients(void) {
+  struct client *client;
+  while ((client = LIST_FIRST(&closed_clients)) != NULL) {
+    LIST_REMOVE(client, closed);
+    free(client);
+  }
+}
+
+/**
+ * Writes @param client's queued replies and updates the events it is polled for.
+ * @return 1 if the client is still open, 0 if it was closed
+ */
+static int flush_event_client(int epoll_fd, struct client *client) {
+  enum flush_result flushed = flush_replies(client);
+  if (flushed == FLUSH_ERROR) {
+    syslog(LOG_ERR, "Failed to write to socket");
+    close_event_client(client);
+    return 0;
+  }
+
+  // a client waiting on a group commit is parked with no events until the flusher signals group_commit.event_fd
+  if (flushed == FLUSH_UNCOMMITTED && !client->is_uncommitted) {
+    LIST_INSERT_HEAD(&uncommitted_clients, client, uncommitted);
+    client->is_uncommitted = 1;
+  } else if (flushed != FLUSH_UNCOMMITTED && client->is_uncommitted) {
+    LIST_REMOVE(client, uncommitted);
+    client->is_uncommitted = 0;
+  }
+
+  struct epoll_event client_event = {.data.ptr = client};
+  client_event.events = flushed == FLUSH_DONE ? EPOLLIN : flushed == FLUSH_WOULD_BLOCK ? EPOLLOUT : 0;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &client_event);
+  return 1;
+}
+
+/**
+ * Single threaded alternative to handle_client_connection, selected with -e.  One epoll instance owns accept,
+ * reads, packet handling and non-blocking replies for every client, so the number of connections is no longer
+ * bounded by the number of threads.  While a client has unsent replies it is only polled for EPOLLOUT, which
+ * keeps a slow reader from growing its reply queue without bound.
+ */
+void run_event_loop(int server_fd) {
+  struct epoll_event events[64];
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    syslog(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+    cleanUpAndExit(EXIT_FAILURE);
+  }
+
+  int flags = fcntl(server_fd, F_GETFL, 0);
+  fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
+
+  // the listening socket is tagged with a NULL client, shutdown_fd and group_commit.event_fd with their addresses
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  struct epoll_event shutdown_event = {.events = EPOLLIN, .data.ptr = &shutdown_fd};
+  struct epoll_event commit_event = {.events = EPOLLIN, .data.ptr = &group_commit.event_fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &shutdown_event) < 0 ||
+      (group_commit.event_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, group_commit.event_fd, &commit_event) < 0)) {
+    syslog(LOG_ERR, "Failed to add server socket to epoll: %s", strerror(errno));
+    cleanUpAndExit(EXIT_FAILURE);
+  }
+
+  while (!should_exit) {
+    int ready = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "Failed to wait for events: %s", strerror(errno));
+      cleanUpAndExit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < ready && !should_exit; i++) {
+      struct client *client = events[i].data.ptr;
+      if (events[i].data.ptr == &shutdown_fd) {
+        continue;
+      }
+      if (events[i].data.ptr == &group_commit.event_fd) {
+        uint64_t commits;
+        read(group_commit.event_fd, &commits, sizeof(commits));
+        struct client *tmp;
+        LIST_FOREACH_SAFE(client, &uncommitted_clients, uncommitted, tmp) { flush_event_client(epoll_fd, client); }
+        continue;
+      }
+
+      if (client == NULL) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int accepted_fd;
+        while ((accepted_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK)) >=
+               0) {
+          client = malloc(sizeof(struct client));
+          if (client == NULL) {
+            syslog(LOG_ERR, "Failed to allocate client");
+            close(accepted_fd);
+            continue;
+          }
+          init_client(client, accepted_fd, &client_addr);
+          struct epoll_event client_event = {.events = EPOLLIN, .data.ptr = client};
+          if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accepted_fd, &client_event) < 0) {
+            syslog(LOG_ERR, "Failed to add client to epoll: %s", strerror(errno));
+            close_event_client(client);
+            continue;
+          }
+          syslog(LOG_INFO, "Accepted connection from %s", client->ip_address);
+          client_addr_len = sizeof(client_addr);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          syslog(LOG_ERR, "Failed to accept connection");
+        }
+        continue;
+      }
+      if (client->fd < 0) {
+        continue; // closed earlier in this batch
+      }
+
+      if (events[i].events & EPOLLIN) {
+        ssize_t in_bytes_read = framer_read(&client->framer, client->fd);
+        if (in_bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          continue;
+        }
+        if (in_bytes_read < 0) {
+          syslog(LOG_ERR, "Failed to read from socket: %s", strerror(errno));
+        }
+        if (in_bytes_read <= 0) {
+          close_event_client(client);
+          continue;
+        }
+        client->framer.end += in_bytes_read;
+        if (!process_input(client)) {
+          close_event_client(client);
+          continue;
+        }
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_event_client(client);
+        continue;
+      }
+
+      flush_event_client(epoll_fd, client);
+    }
+    free_closed_clients();
+  }
+
+  close(epoll_fd);
 }
 
 void deamonize(char *base_name) {
@@ -264,28 +1126,32 @@ void deamonize(char *base_name) {
   setlogmask(LOG_UPTO(LOG_INFO));
 }
 
-void mark_all_threads_complete(struct connections_t *connections) {
-  struct connection *conn;
-  pthread_mutex_lock(&connections_lock);
-  SLIST_FOREACH(conn, connections, entries) { conn->thread_complete = 1; }
-  pthread_mutex_unlock(&connections_lock);
-}
-
-void collect_complete_threads(struct connections_t *connections) {
-  struct connection *conn;
-
-  pthread_mutex_lock(&connections_lock);
-  SLIST_FOREACH(conn, connections, entries) {
-    if (conn->thread_complete) {
-      syslog(LOG_INFO, "Joining thread %lu", conn->thread_id);
-      pthread_join(conn->thread_id, NULL);
-      SLIST_REMOVE(connections, conn, connection, entries);
-      free(conn);
+/**
+ * Wakes and joins every worker thread, they exit promptly once should_exit is set and shutdown_fd is signalled.
+ * Workers only get here on a fatal error and skip joining themselves.  Connections still queued are closed.
+ */
+void join_worker_threads(void) {
+  pthread_mutex_lock(&connection_queue.lock);
+  pthread_cond_broadcast(&connection_queue.not_empty);
+  pthread_cond_broadcast(&connection_queue.not_full);
+  pthread_mutex_unlock(&connection_queue.lock);
+
+  for (long i = 0; i < worker_thread_count; i++) {
+    if (!pthread_equal(worker_threads[i], pthread_self())) {
+      pthread_join(worker_threads[i], NULL);
     }
   }
-  pthread_mutex_unlock(&connections_lock);
+
+  pthread_mutex_lock(&connection_queue.lock);
+  while (connection_queue.count > 0) {
+    close(connection_queue.connections[connection_queue.head].fd);
+    connection_queue.head = (connection_queue.head + 1) % CONNECTION_QUEUE_SIZE;
+    connection_queue.count--;
+  }
+  pthread_mutex_unlock(&connection_queue.lock);
 }
 
+#if USE_AESD_CHAR_DEVICE == 0
 void *timer(void *arg) {
   char out_buffer[64];
   const char preamble[] = "timestamp:";
@@ -301,29 +1167,30 @@ void *timer(void *arg) {
       syslog(LOG_ERR, "Failed to format time %s", strerror(errno));
     }
 
-    { // start file_lock
-      if (pthread_mutex_lock(&file_lock)) {
-        syslog(LOG_ERR, "Failed to lock file: %s", strerror(errno));
-        cleanUpAndExit(EXIT_FAILURE);
-      }
-      write(file_fd, out_buffer, strlen(out_buffer));
-      if (pthread_mutex_unlock(&file_lock)) {
-        syslog(LOG_ERR, "Failed to lock file: %s", strerror(errno));
-        cleanUpAndExit(EXIT_FAILURE);
-      }
-    } // end file_lock
+    if (!history_append(out_buffer, strlen(out_buffer))) {
+      syslog(LOG_ERR, "Failed to write timestamp: %s", strerror(errno));
+    }
 
     sleep(10);
   }
   return NULL;
 }
+#endif
 
 int main(int argc, char *argv[]) {
 
   struct options options = {
       .port = 9000,
+      .threads = sysconf(_SC_NPROCESSORS_ONLN),
+      .durability = DURABILITY_PER_PACKET,
+      .group_commit_window_usec = 1000,
+      .max_packet_size = DEFAULT_MAX_PACKET_SIZE,
   };
   parseArgs(argc, argv, &options);
+  max_packet_size = options.max_packet_size;
+  zero_copy = options.zero_copy;
+  durability = options.durability;
+  group_commit.window_usec = options.group_commit_window_usec;
 
   char *base_name = basename(argv[0]);
   fprintf(stdout, "Starting %s %s \n", base_name, GIT_HASH);
@@ -331,7 +1198,12 @@ int main(int argc, char *argv[]) {
   openlog(base_name, LOG_PID, LOG_USER);
   setlogmask(LOG_UPTO(LOG_INFO));
 
+#if USE_AESD_CHAR_DEVICE
   file_fd = open(file_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#else
+  // the history index starts empty, so must the data file
+  file_fd = open(file_path, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#endif
   if (file_fd < 0) {
     syslog(LOG_ERR, "Failed to open file %s", file_path);
     cleanUpAndExit(EXIT_FAILURE);
@@ -372,11 +1244,24 @@ int main(int argc, char *argv[]) {
     deamonize(base_name);
   }
 
+  shutdown_fd = eventfd(0, EFD_CLOEXEC);
+  if (shutdown_fd < 0) {
+    syslog(LOG_ERR, "Failed to create shutdown eventfd: %s", strerror(errno));
+    cleanUpAndExit(EXIT_FAILURE);
+  }
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
-
-  struct connection *conn;
-  SLIST_INIT(&connections);
+  // a client that disconnects in the middle of a reply must fail that write with EPIPE, not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (durability == DURABILITY_GROUP_COMMIT) {
+    group_commit.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (group_commit.event_fd < 0 || pthread_create(&flusher_thread, NULL, &flusher, NULL) != 0) {
+      syslog(LOG_ERR, "Failed to start group commit flusher");
+      cleanUpAndExit(EXIT_FAILURE);
+    }
+    flusher_started = 1;
+  }
 
 #if USE_AESD_CHAR_DEVICE == 0
   pthread_create(&timer_thread, NULL, &timer, NULL);
@@ -384,34 +1269,48 @@ int main(int argc, char *argv[]) {
 
   fprintf(stdout, "Waiting for connection on port %d\n", options.port);
 
+  if (options.event_loop) {
+    run_event_loop(server_fd);
+    syslog(LOG_INFO, "Caught signal, exiting");
+    cleanUpAndExit(EXIT_SUCCESS);
+  }
+
+  if (options.threads <= 0) {
+    options.threads = 1;
+  }
+  worker_threads = calloc(options.threads, sizeof(pthread_t));
+  if (worker_threads == NULL) {
+    syslog(LOG_ERR, "Failed to allocate worker threads");
+    cleanUpAndExit(EXIT_FAILURE);
+  }
+  for (; worker_thread_count < options.threads; worker_thread_count++) {
+    if (pthread_create(&worker_threads[worker_thread_count], NULL, &worker, NULL) != 0) {
+      syslog(LOG_ERR, "Failed to create worker thread");
+      cleanUpAndExit(EXIT_FAILURE);
+    }
+  }
+  syslog(LOG_INFO, "Started %ld worker threads", worker_thread_count);
+
   while (!should_exit) {
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
+    if (wait_for_client(server_fd, POLLIN) <= 0) {
+      continue;
+    }
+
     int accepted_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
     if (accepted_fd < 0) {
       syslog(LOG_ERR, "Failed to accept connection");
       continue;
     }
 
-    conn = malloc(sizeof(struct connection));
-    conn->fd = accepted_fd;
-    conn->addr = client_addr;
-    conn->thread_complete = 0;
-
-    if (pthread_create(&conn->thread_id, NULL, &handle_client_connection, conn) != 0) {
-      syslog(LOG_ERR, "Failed to create thread");
-      free(conn);
+    struct connection conn = {.fd = accepted_fd, .addr = client_addr};
+    if (!connection_queue_push(&connection_queue, &conn)) {
       close(accepted_fd);
-      continue;
     }
-
-    pthread_mutex_lock(&connections_lock);
-    SLIST_INSERT_HEAD(&connections, conn, entries);
-    pthread_mutex_unlock(&connections_lock);
-
-    collect_complete_threads(&connections);
   }
 
+  syslog(LOG_INFO, "Caught signal, exiting");
   cleanUpAndExit(EXIT_SUCCESS);
 }
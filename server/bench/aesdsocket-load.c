@@ -0,0 +1,423 @@
+/**
+ * @file aesdsocket-load.c
+ * @brief Load generator and latency benchmark for aesdsocket.
+ *
+ * Opens a number of concurrent connections, each sending newline terminated packets of a fixed size and waiting
+ * for the reply that echoes it back as part of the history.  Every received line is validated: it must be a
+ * timestamp or a well formed packet (possibly from an earlier run), and a connection must never see one of its own
+ * packets before sending it.  Latency is measured from sending a packet to the first time it shows up on that
+ * connection.  A connection is closed once all its packets were echoed, so a worker pool with fewer threads than
+ * connections moves on to the next one.  The exit status is non zero on validation errors or timeouts, so the tool
+ * can be used as a regression gate.
+ *
+ * Usage: aesdsocket-load [-a <address>] [-p <port>] [-c <connections>] [-n <packets>] [-s <packet size>]
+ *                        [-r <packets/sec per connection>] [-t <timeout sec>]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PACKET_PREFIX "aesdload "
+#define TIMESTAMP_PREFIX "timestamp:"
+#define MIN_PACKET_SIZE 32
+#define LINE_BUFFER_SIZE (64 * 1024)
+
+struct options {
+  const char *address;
+  in_port_t port;
+  int connections;
+  int packets;
+  size_t packet_size;
+  double rate;
+  int timeout;
+  size_t line_buffer_size; // longest line kept for validation, at least a whole packet
+};
+
+struct load_connection {
+  int run;
+  int id;
+  int fd;
+  int seq;          // sequence number of the packet in flight, or of the next packet to send
+  int in_flight;    // a packet was sent and its echo has not been seen yet
+  size_t sent;      // bytes of the in flight packet already written
+  int want_write;   // EPOLLOUT is armed because the socket did not take the whole packet
+  uint64_t sent_at; // usec timestamp of the first byte of the in flight packet
+  uint64_t next_send_at;
+  char *packet;
+  char *line;
+  size_t line_len;
+};
+
+struct stats {
+  uint32_t *latencies;
+  size_t latency_count;
+  uint64_t bytes_received;
+  uint64_t lines_received;
+  uint64_t corrupt_lines;
+  uint64_t out_of_order;
+};
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(char *argv[]) {
+  fprintf(stderr,
+          "Usage: %s [-a <address>] [-p <port>] [-c <connections>] [-n <packets>] [-s <packet size>]\n"
+          "          [-r <packets/sec per connection>] [-t <timeout sec>]\n",
+          argv[0]);
+  exit(EXIT_FAILURE);
+}
+
+static void parse_args(int argc, char *argv[], struct options *options) {
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:c:n:s:r:t:")) != -1) {
+    switch (opt) {
+    case 'a':
+      options->address = optarg;
+      break;
+    case 'p':
+      options->port = (in_port_t)strtol(optarg, NULL, 10);
+      break;
+    case 'c':
+      options->connections = atoi(optarg);
+      break;
+    case 'n':
+      options->packets = atoi(optarg);
+      break;
+    case 's':
+      options->packet_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      options->rate = strtod(optarg, NULL);
+      break;
+    case 't':
+      options->timeout = atoi(optarg);
+      break;
+    default:
+      usage(argv);
+    }
+  }
+  if (options->connections <= 0 || options->packets <= 0 || options->packet_size < MIN_PACKET_SIZE ||
+      options->rate < 0 || options->timeout <= 0) {
+    fprintf(stderr, "Connections, packets and timeout must be positive and packet size at least %d\n",
+            MIN_PACKET_SIZE);
+    usage(argv);
+  }
+  options->line_buffer_size = options->packet_size < LINE_BUFFER_SIZE ? LINE_BUFFER_SIZE : options->packet_size;
+}
+
+/**
+ * Formats packet @param seq of connection @param id in run @param run, padded with a repeating pattern to
+ * @param packet_size bytes including the trailing newline.
+ */
+static void format_packet(char *packet, size_t packet_size, int run, int id, int seq) {
+  size_t header_len = snprintf(packet, packet_size, PACKET_PREFIX "%d %d %d ", run, id, seq);
+  for (size_t i = header_len; i < packet_size - 1; i++) {
+    packet[i] = 'a' + (i % 26);
+  }
+  packet[packet_size - 1] = '\n';
+}
+
+/**
+ * Checks a received line (without its newline) and records the latency when it is the packet @param conn has in
+ * flight.
+ */
+static void handle_line(struct load_connection *conn, const char *line, size_t line_len,
+                        const struct options *options, struct stats *stats) {
+  stats->lines_received++;
+  if (line_len >= strlen(TIMESTAMP_PREFIX) && memcmp(line, TIMESTAMP_PREFIX, strlen(TIMESTAMP_PREFIX)) == 0) {
+    return;
+  }
+
+  int run, id, seq;
+  char header[64];
+  if (line_len < MIN_PACKET_SIZE - 1 || line_len >= options->line_buffer_size ||
+      sscanf(line, PACKET_PREFIX "%d %d %d ", &run, &id, &seq) != 3 || id < 0 || seq < 0) {
+    stats->corrupt_lines++;
+    return;
+  }
+  // compared in place against what format_packet writes, as packets may be larger than the stack
+  size_t header_len = snprintf(header, sizeof(header), PACKET_PREFIX "%d %d %d ", run, id, seq);
+  if (header_len > line_len) {
+    header_len = line_len;
+  }
+  if (memcmp(header, line, header_len) != 0) {
+    stats->corrupt_lines++;
+    return;
+  }
+  for (size_t i = header_len; i < line_len; i++) {
+    if (line[i] != 'a' + (i % 26)) {
+      stats->corrupt_lines++;
+      return;
+    }
+  }
+
+  if (run != conn->run || id != conn->id) {
+    return;
+  }
+  if (line_len != options->packet_size - 1 || seq >= options->packets) {
+    stats->corrupt_lines++;
+    return;
+  }
+  if (seq > conn->seq || (seq == conn->seq && !conn->in_flight)) {
+    // history can only hold our packets that were already sent
+    stats->out_of_order++;
+  } else if (seq == conn->seq) {
+    stats->latencies[stats->latency_count++] = now_usec() - conn->sent_at;
+    conn->in_flight = 0;
+    conn->seq++;
+  }
+}
+
+/**
+ * Reads everything available on @param conn and validates each complete line.
+ * @return 0 if the connection failed or was closed by the server
+ */
+static int receive(struct load_connection *conn, const struct options *options, struct stats *stats) {
+  char buffer[64 * 1024];
+  while (1) {
+    ssize_t ret = read(conn->fd, buffer, sizeof(buffer));
+    if (ret < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (ret == 0) {
+      return 0;
+    }
+    stats->bytes_received += ret;
+
+    char *start = buffer;
+    char *end = buffer + ret;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+      size_t len = newline - start;
+      if (conn->line_len > 0) {
+        if (conn->line_len + len <= options->line_buffer_size) {
+          memcpy(conn->line + conn->line_len, start, len);
+        }
+        handle_line(conn, conn->line, conn->line_len + len, options, stats);
+        conn->line_len = 0;
+      } else {
+        handle_line(conn, start, len, options, stats);
+      }
+      start = newline + 1;
+    }
+    size_t remaining = end - start;
+    if (conn->line_len + remaining <= options->line_buffer_size) {
+      memcpy(conn->line + conn->line_len, start, remaining);
+    }
+    conn->line_len += remaining;
+  }
+}
+
+/**
+ * Writes as much of the in flight packet as the socket accepts, starting a new one when it is time.
+ * @return 0 if the connection failed
+ */
+static int send_packet(struct load_connection *conn, const struct options *options) {
+  if (!conn->in_flight) {
+    if (conn->seq >= options->packets || now_usec() < conn->next_send_at) {
+      return 1;
+    }
+    format_packet(conn->packet, options->packet_size, conn->run, conn->id, conn->seq);
+    conn->in_flight = 1;
+    conn->sent = 0;
+    conn->sent_at = now_usec();
+    if (options->rate > 0) {
+      conn->next_send_at += 1000000 / options->rate;
+    }
+  }
+  while (conn->sent < options->packet_size) {
+    ssize_t ret = write(conn->fd, conn->packet + conn->sent, options->packet_size - conn->sent);
+    if (ret < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn->sent += ret;
+  }
+  return 1;
+}
+
+/**
+ * Arms EPOLLOUT on @param conn while its packet is only partly written, so the rest is sent as soon as the socket
+ * drains instead of at the next timer wakeup, and disarms it once the packet is out.
+ * @return 0 if epoll_ctl failed
+ */
+static int update_events(int epoll_fd, struct load_connection *conn, const struct options *options) {
+  int want_write = conn->in_flight && conn->sent < options->packet_size;
+  if (want_write == conn->want_write) {
+    return 1;
+  }
+  struct epoll_event event = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = conn};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+    return 0;
+  }
+  conn->want_write = want_write;
+  return 1;
+}
+
+static int compare_uint32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const struct stats *stats, double p) {
+  size_t index = (size_t)(p * (stats->latency_count - 1) + 0.5);
+  return stats->latencies[index];
+}
+
+static void report(const struct options *options, const struct stats *stats, uint64_t elapsed_usec) {
+  double seconds = elapsed_usec / 1e6;
+  printf("connections %d, packets %d x %zu bytes, elapsed %.3f s\n", options->connections, options->packets,
+         options->packet_size, seconds);
+  printf("throughput  %.1f packets/s, %.2f MiB/s of replies\n", stats->latency_count / seconds,
+         stats->bytes_received / seconds / (1024 * 1024));
+  printf("validation  %lu lines, %lu corrupt, %lu out of order, %zu/%lu packets echoed\n",
+         (unsigned long)stats->lines_received, (unsigned long)stats->corrupt_lines,
+         (unsigned long)stats->out_of_order, stats->latency_count,
+         (unsigned long)options->connections * options->packets);
+  if (stats->latency_count == 0) {
+    return;
+  }
+
+  printf("latency     p50 %u us, p99 %u us, p999 %u us, max %u us\n", percentile(stats, 0.5),
+         percentile(stats, 0.99), percentile(stats, 0.999), stats->latencies[stats->latency_count - 1]);
+
+  // power of two buckets, stats->latencies is sorted
+  size_t index = 0;
+  for (uint64_t bucket = 1; index < stats->latency_count; bucket *= 2) {
+    size_t count = 0;
+    while (index < stats->latency_count && stats->latencies[index] < bucket) {
+      count++;
+      index++;
+    }
+    if (count > 0) {
+      printf("  < %8lu us %8zu %6.2f%%\n", (unsigned long)bucket, count, 100.0 * count / stats->latency_count);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct options options = {
+      .address = "127.0.0.1",
+      .port = 9000,
+      .connections = 10,
+      .packets = 100,
+      .packet_size = 64,
+      .rate = 0,
+      .timeout = 60,
+  };
+  parse_args(argc, argv, &options);
+
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(options.port)};
+  if (inet_pton(AF_INET, options.address, &addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid address %s\n", options.address);
+    return EXIT_FAILURE;
+  }
+
+  struct stats stats = {0};
+  stats.latencies = calloc((size_t)options.connections * options.packets, sizeof(uint32_t));
+  struct load_connection *conns = calloc(options.connections, sizeof(struct load_connection));
+  int epoll_fd = epoll_create1(0);
+  if (stats.latencies == NULL || conns == NULL || epoll_fd < 0) {
+    perror("setup");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t start = now_usec();
+  for (int i = 0; i < options.connections; i++) {
+    struct load_connection *conn = &conns[i];
+    conn->run = getpid();
+    conn->id = i;
+    conn->packet = malloc(options.packet_size);
+    conn->line = malloc(options.line_buffer_size);
+    conn->next_send_at = start;
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->packet == NULL || conn->line == NULL || conn->fd < 0 ||
+        connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      perror("connect");
+      return EXIT_FAILURE;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+  }
+
+  int failed = 0;
+  size_t expected = (size_t)options.connections * options.packets;
+  uint64_t deadline = start + (uint64_t)options.timeout * 1000000;
+  struct epoll_event events[64];
+  while (stats.latency_count < expected && !failed) {
+    uint64_t now = now_usec();
+    if (now >= deadline) {
+      fprintf(stderr, "Timed out after %d s\n", options.timeout);
+      failed = 1;
+      break;
+    }
+
+    uint64_t next_wakeup = deadline;
+    for (int i = 0; i < options.connections && !failed; i++) {
+      if (conns[i].fd < 0) {
+        continue;
+      }
+      if (!send_packet(&conns[i], &options)) {
+        perror("write");
+        failed = 1;
+      } else if (!update_events(epoll_fd, &conns[i], &options)) {
+        perror("epoll_ctl");
+        failed = 1;
+      }
+      if (!conns[i].in_flight && conns[i].seq < options.packets && conns[i].next_send_at < next_wakeup) {
+        next_wakeup = conns[i].next_send_at;
+      }
+    }
+
+    int timeout_ms = next_wakeup > now ? (next_wakeup - now + 999) / 1000 : 0;
+    int ready = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+    for (int i = 0; i < ready && !failed; i++) {
+      struct load_connection *conn = events[i].data.ptr;
+      if ((events[i].events & EPOLLOUT) && !send_packet(conn, &options)) {
+        perror("write");
+        failed = 1;
+      } else if (!receive(conn, &options, &stats)) {
+        fprintf(stderr, "Connection %d closed by server\n", conn->id);
+        failed = 1;
+      } else if (conn->seq == options.packets) {
+        close(conn->fd);
+        conn->fd = -1;
+      }
+    }
+  }
+  uint64_t elapsed = now_usec() - start;
+
+  qsort(stats.latencies, stats.latency_count, sizeof(uint32_t), compare_uint32);
+  report(&options, &stats, elapsed);
+
+  for (int i = 0; i < options.connections; i++) {
+    if (conns[i].fd >= 0) {
+      close(conns[i].fd);
+    }
+    free(conns[i].packet);
+    free(conns[i].line);
+  }
+  free(conns);
+  free(stats.latencies);
+  close(epoll_fd);
+
+  if (failed || stats.corrupt_lines > 0 || stats.out_of_order > 0 || stats.latency_count < expected) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
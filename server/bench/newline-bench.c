@@ -0,0 +1,123 @@
+/**
+ * @file newline-bench.c
+ * @brief Compares ways of finding packet boundaries in a large write: the strchr loop aesdsocket used, the per line
+ * memchr loop of aesd_write and the single pass aesd_find_newlines.  Reports GiB/s for each and checks that they
+ * agree on the number of packets.
+ *
+ * Usage: newline-bench [-s <buffer size KiB>] [-l <average line length>] [-n <iterations>]
+ */
+#include "../../aesd-char-driver/aesd-newline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_POSITIONS 64
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t scan_strchr(const char *buffer, size_t size) {
+  size_t packets = 0;
+  const char *prev = buffer;
+  const char *newline;
+  while ((newline = strchr(prev, '\n')) != NULL) {
+    packets++;
+    prev = newline + 1;
+  }
+  return packets;
+}
+
+static size_t scan_memchr(const char *buffer, size_t size) {
+  size_t packets = 0;
+  const char *end = buffer + size;
+  const char *prev = buffer;
+  const char *newline;
+  while (prev < end && (newline = memchr(prev, '\n', end - prev)) != NULL) {
+    packets++;
+    prev = newline + 1;
+  }
+  return packets;
+}
+
+static size_t scan_find_newlines(const char *buffer, size_t size) {
+  size_t positions[MAX_POSITIONS];
+  size_t packets = 0;
+  size_t start = 0;
+  size_t count;
+  while ((count = aesd_find_newlines(buffer + start, size - start, positions, MAX_POSITIONS)) > 0) {
+    packets += count;
+    start += positions[count - 1] + 1;
+  }
+  return packets;
+}
+
+static void run(const char *name, size_t (*scan_fn)(const char *, size_t), const char *buffer, size_t size,
+                int iterations, size_t expected) {
+  size_t packets = 0;
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i++) {
+    packets = scan_fn(buffer, size);
+  }
+  double elapsed = now_seconds() - start;
+  printf("%-14s %8.2f GiB/s %10.1f Mpackets/s%s\n", name, (double)size * iterations / elapsed / (1 << 30),
+         (double)packets * iterations / elapsed / 1e6, packets == expected ? "" : "  WRONG PACKET COUNT");
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = 16 * 1024 * 1024;
+  size_t line_length = 32;
+  int iterations = 20;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:l:n:")) != -1) {
+    switch (opt) {
+    case 's':
+      size = strtoul(optarg, NULL, 10) * 1024;
+      break;
+    case 'l':
+      line_length = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s <buffer size KiB>] [-l <average line length>] [-n <iterations>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (size == 0 || line_length == 0 || iterations <= 0) {
+    fprintf(stderr, "Buffer size, line length and iterations must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  // NUL terminated for the strchr loop, line lengths vary between 1 and twice the average
+  char *buffer = malloc(size + 1);
+  size_t expected = 0;
+  srand(1);
+  for (size_t i = 0; i < size;) {
+    size_t len = 1 + rand() % (2 * line_length);
+    for (size_t j = 0; j + 1 < len && i < size; j++) {
+      buffer[i] = 'a' + (i % 26);
+      i++;
+    }
+    if (i < size) {
+      buffer[i++] = '\n';
+      expected++;
+    }
+  }
+  buffer[size] = '\0';
+
+  printf("Scanning %zu KiB with %zu packets of ~%zu bytes, %d times\n", size / 1024, expected, line_length,
+         iterations);
+  run("strchr-loop", scan_strchr, buffer, size, iterations, expected);
+  run("memchr-loop", scan_memchr, buffer, size, iterations, expected);
+  run("find-newlines", scan_find_newlines, buffer, size, iterations, expected);
+
+  free(buffer);
+  return EXIT_SUCCESS;
+}
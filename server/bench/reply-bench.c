@@ -0,0 +1,207 @@
+/**
+ * @file reply-bench.c
+ * @brief Compares the aesdsocket reply paths for the data file: the original 1 KiB read/write loop, writev from
+ * cached history segments and sendfile straight from the file.  Each method streams the whole file to a loopback
+ * TCP socket drained by a second thread and reports bytes/sec.
+ *
+ * Usage: reply-bench [-s <file size KiB>] [-n <iterations>]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SEGMENT_SIZE (64 * 1024)
+#define IOV_BATCH 64
+
+struct drain_args {
+  int fd;
+  size_t expected;
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *drain(void *arg) {
+  struct drain_args *args = arg;
+  char buffer[256 * 1024];
+  size_t received = 0;
+  while (received < args->expected) {
+    ssize_t ret = read(args->fd, buffer, sizeof(buffer));
+    if (ret <= 0) {
+      perror("read");
+      exit(EXIT_FAILURE);
+    }
+    received += ret;
+  }
+  return NULL;
+}
+
+static int write_buffer(int fd, const char *buffer, size_t buffer_len) {
+  size_t bytes_written = 0;
+  while (bytes_written < buffer_len) {
+    ssize_t ret = write(fd, buffer + bytes_written, buffer_len - bytes_written);
+    if (ret < 0) {
+      return 0;
+    }
+    bytes_written += ret;
+  }
+  return 1;
+}
+
+// The reply loop aesdsocket used originally
+static void send_copy_loop(int sock_fd, int file_fd, char **segments, size_t file_size) {
+  char out_buffer[1024];
+  ssize_t file_bytes_read;
+  lseek(file_fd, 0, SEEK_SET);
+  while ((file_bytes_read = read(file_fd, out_buffer, sizeof(out_buffer))) > 0) {
+    write_buffer(sock_fd, out_buffer, file_bytes_read);
+  }
+}
+
+static void send_segments(int sock_fd, int file_fd, char **segments, size_t file_size) {
+  struct iovec iov[IOV_BATCH];
+  size_t pos = 0;
+  while (pos < file_size) {
+    int iovcnt = 0;
+    size_t batch_pos = pos;
+    while (batch_pos < file_size && iovcnt < IOV_BATCH) {
+      size_t offset = batch_pos % SEGMENT_SIZE;
+      iov[iovcnt].iov_base = segments[batch_pos / SEGMENT_SIZE] + offset;
+      iov[iovcnt].iov_len = MIN(SEGMENT_SIZE - offset, file_size - batch_pos);
+      batch_pos += iov[iovcnt].iov_len;
+      iovcnt++;
+    }
+    ssize_t ret = writev(sock_fd, iov, iovcnt);
+    if (ret < 0) {
+      perror("writev");
+      exit(EXIT_FAILURE);
+    }
+    pos += ret;
+  }
+}
+
+static void send_sendfile(int sock_fd, int file_fd, char **segments, size_t file_size) {
+  off_t offset = 0;
+  while ((size_t)offset < file_size) {
+    if (sendfile(sock_fd, file_fd, &offset, file_size - offset) < 0) {
+      perror("sendfile");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void connect_pair(int *send_fd, int *recv_fd) {
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addr_len = sizeof(addr);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0 ||
+      getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+  *send_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (*send_fd < 0 || connect(*send_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  *recv_fd = accept(listen_fd, NULL, NULL);
+  if (*recv_fd < 0) {
+    perror("accept");
+    exit(EXIT_FAILURE);
+  }
+  close(listen_fd);
+}
+
+static void run(const char *name, void (*send_fn)(int, int, char **, size_t), int file_fd, char **segments,
+                size_t file_size, int iterations) {
+  int send_fd, recv_fd;
+  pthread_t drain_thread;
+  struct drain_args args;
+
+  connect_pair(&send_fd, &recv_fd);
+  args.fd = recv_fd;
+  args.expected = file_size * iterations;
+  pthread_create(&drain_thread, NULL, drain, &args);
+
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i++) {
+    send_fn(send_fd, file_fd, segments, file_size);
+  }
+  pthread_join(drain_thread, NULL);
+  double elapsed = now_seconds() - start;
+
+  printf("%-10s %10.1f MiB/s\n", name, args.expected / elapsed / (1024 * 1024));
+  close(send_fd);
+  close(recv_fd);
+}
+
+int main(int argc, char *argv[]) {
+  size_t file_size = 1024 * 1024;
+  int iterations = 200;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+    switch (opt) {
+    case 's':
+      file_size = strtoul(optarg, NULL, 10) * 1024;
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s <file size KiB>] [-n <iterations>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (file_size == 0 || iterations <= 0) {
+    fprintf(stderr, "File size and iterations must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  char file_path[] = "/tmp/reply-bench-XXXXXX";
+  int file_fd = mkstemp(file_path);
+  if (file_fd < 0) {
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  unlink(file_path);
+
+  size_t segment_count = (file_size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+  char **segments = calloc(segment_count, sizeof(char *));
+  for (size_t i = 0; i < segment_count; i++) {
+    size_t len = MIN(SEGMENT_SIZE, file_size - i * SEGMENT_SIZE);
+    segments[i] = malloc(SEGMENT_SIZE);
+    for (size_t j = 0; j < len; j++) {
+      segments[i][j] = (j % 80 == 79) ? '\n' : 'a' + (j % 26);
+    }
+    write_buffer(file_fd, segments[i], len);
+  }
+
+  printf("Streaming a %zu KiB file %d times\n", file_size / 1024, iterations);
+  run("copy-loop", send_copy_loop, file_fd, segments, file_size, iterations);
+  run("writev", send_segments, file_fd, segments, file_size, iterations);
+  run("sendfile", send_sendfile, file_fd, segments, file_size, iterations);
+
+  for (size_t i = 0; i < segment_count; i++) {
+    free(segments[i]);
+  }
+  free(segments);
+  close(file_fd);
+  return EXIT_SUCCESS;
+}
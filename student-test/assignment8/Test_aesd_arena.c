@@ -0,0 +1,279 @@
+#include "../../aesd-char-driver/aesd-arena.h"
+#include "unity.h"
+#include <string.h>
+
+/**
+ * Appends @param text to @param span through @param arena, the way aesd_write does
+ */
+static char *append(struct aesd_arena *arena, struct aesd_buffer_entry *span, const char *text) {
+  char *data = aesd_arena_reserve(arena, span, strlen(text));
+  TEST_ASSERT_NOT_NULL_MESSAGE(data, "Reservation failed");
+  memcpy(data, text, strlen(text));
+  aesd_arena_commit(arena, span, strlen(text));
+  return data;
+}
+
+static void release(struct aesd_buffer_entry *span) {
+  aesd_arena_put(span->owner);
+  span->owner = NULL;
+  span->size = 0;
+}
+
+void test_arena_appends_in_place() {
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  aesd_arena_init(&arena, 64);
+
+  char *first = append(&arena, &span, "hello ");
+  struct aesd_arena_chunk *chunk = arena.current;
+  char *second = append(&arena, &span, "world\n");
+
+  TEST_ASSERT_EQUAL_PTR_MESSAGE(first + 6, second, "A span at the tail of the chunk should grow in place");
+  TEST_ASSERT_EQUAL_PTR_MESSAGE(chunk, arena.current, "Appending in place should not allocate a chunk");
+  TEST_ASSERT_EQUAL_MEMORY("hello world\n", span.buffptr, 12);
+  TEST_ASSERT_EQUAL(12, span.size);
+  TEST_ASSERT_EQUAL_UINT(2, chunk->refs);
+
+  release(&span);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_moves_span_to_new_chunk() {
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  char rest[256];
+  aesd_arena_init(&arena, 128);
+
+  append(&arena, &span, "0123456789");
+  struct aesd_arena_chunk *first_chunk = arena.current;
+  // one byte more than the rest of the chunk holds
+  size_t rest_size = first_chunk->size - first_chunk->used + 1;
+  memset(rest, 'a', rest_size);
+  rest[rest_size] = '\0';
+  append(&arena, &span, rest);
+
+  TEST_ASSERT_TRUE_MESSAGE(first_chunk != arena.current, "A span that does not fit should move to a new chunk");
+  TEST_ASSERT_EQUAL_PTR(arena.current, span.owner);
+  TEST_ASSERT_EQUAL_PTR(arena.current->data, span.buffptr);
+  TEST_ASSERT_EQUAL_MEMORY("0123456789", span.buffptr, 10);
+  TEST_ASSERT_EQUAL_MEMORY(rest, span.buffptr + 10, rest_size);
+  TEST_ASSERT_TRUE_MESSAGE(arena.current->size >= 10 + rest_size, "A large span should get a chunk it fits in");
+  TEST_ASSERT_EQUAL_UINT(2, arena.current->refs);
+
+  release(&span);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_trickled_packet_moves_logarithmically() {
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  struct aesd_arena_chunk *chunk = NULL;
+  int moves = 0;
+  aesd_arena_init(&arena, 16);
+
+  for (int i = 0; i < 10000; i++) {
+    append(&arena, &span, i % 26 == 25 ? "z" : "a");
+    if (arena.current != chunk) {
+      chunk = arena.current;
+      moves++;
+    }
+  }
+  TEST_ASSERT_EQUAL(10000, span.size);
+  TEST_ASSERT_TRUE_MESSAGE(moves <= 11, "A growing packet should double its chunk when it moves");
+
+  release(&span);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_entries_share_chunk_references() {
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  struct aesd_buffer_entry entries[3];
+  aesd_arena_init(&arena, 64);
+
+  // split three packets off the front of the span, each holding its own reference
+  append(&arena, &span, "one\ntwo\nthree\npart");
+  struct aesd_arena_chunk *chunk = arena.current;
+  const char *packets[] = {"one\n", "two\n", "three\n"};
+  for (int i = 0; i < 3; i++) {
+    entries[i].buffptr = span.buffptr;
+    entries[i].size = strlen(packets[i]);
+    entries[i].owner = span.owner;
+    aesd_arena_get(entries[i].owner);
+    span.buffptr += entries[i].size;
+    span.size -= entries[i].size;
+    TEST_ASSERT_EQUAL_MEMORY(packets[i], entries[i].buffptr, entries[i].size);
+  }
+  TEST_ASSERT_EQUAL_UINT(5, chunk->refs);
+
+  append(&arena, &span, "ial\n");
+  TEST_ASSERT_EQUAL_MEMORY("partial\n", span.buffptr, 8);
+
+  for (int i = 0; i < 3; i++) {
+    release(&entries[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT(2, chunk->refs);
+  release(&span);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_empty_span_moves_to_current_chunk() {
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  struct aesd_buffer_entry other = {0};
+  char text[256];
+  aesd_arena_init(&arena, 128);
+
+  append(&arena, &span, "0123456789\n");
+  struct aesd_arena_chunk *first_chunk = arena.current;
+  // too large for the rest of the first chunk, leaving room in the next one
+  size_t text_size = first_chunk->size - 5;
+  memset(text, 'a', text_size);
+  text[text_size] = '\0';
+  append(&arena, &other, text);
+  release(&span);
+
+  // the next bytes of an emptied span go wherever the arena's tail is
+  append(&arena, &span, "x");
+  TEST_ASSERT_EQUAL_PTR(arena.current, span.owner);
+  TEST_ASSERT_TRUE(first_chunk != arena.current);
+  TEST_ASSERT_EQUAL_UINT(3 + arena.spare_refs, arena.current->refs);
+
+  release(&span);
+  release(&other);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_handed_over_spans_use_spare_refs() {
+  static struct aesd_buffer_entry entries[100];
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  unsigned int changes = 0;
+  aesd_arena_init(&arena, AESD_ARENA_CHUNK_SIZE);
+
+  // grow to a full chunk first, with room left for the lines below
+  while (arena.current == NULL || sizeof(struct aesd_arena_chunk) + arena.current->size < AESD_ARENA_CHUNK_SIZE) {
+    append(&arena, &span, "line\n");
+    release(&span);
+  }
+  struct aesd_arena_chunk *chunk = arena.current;
+  unsigned int refs = chunk->refs;
+
+  // each line becomes an entry taking over the span's reference, the way aesd_write_iter hands packets over
+  for (int i = 0; i < 100; i++) {
+    append(&arena, &span, "line\n");
+    TEST_ASSERT_EQUAL_PTR(chunk, span.owner);
+    entries[i] = span;
+    span.owner = NULL;
+    span.size = 0;
+    if (chunk->refs != refs) {
+      refs = chunk->refs;
+      changes++;
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT_MESSAGE(100 / AESD_ARENA_SPARE_REFS + 1, changes,
+                                 "Spans should take their references from the arena's spare ones");
+  TEST_ASSERT_EQUAL_UINT(100 + 1 + arena.spare_refs, chunk->refs);
+
+  for (int i = 0; i < 100; i++) {
+    release(&entries[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT(1 + arena.spare_refs, chunk->refs);
+  aesd_arena_destroy(&arena);
+}
+
+void test_arena_cache_reuses_freed_chunks() {
+  struct aesd_arena_cache cache;
+  struct aesd_arena arena;
+  struct aesd_buffer_entry span = {0};
+  aesd_arena_cache_init(&cache, 128, 512);
+  aesd_arena_init(&arena, 128);
+  arena.cache = &cache;
+
+  // large enough for a first chunk of the size class
+  append(&arena, &span, "0123456789abcdefghij0123456789abcdefghij0123456789abcdefghij\n");
+  struct aesd_arena_chunk *chunk = arena.current;
+  TEST_ASSERT_EQUAL_MESSAGE(128 - sizeof(struct aesd_arena_chunk), chunk->size,
+                            "A chunk and its header should take exactly chunk_size bytes");
+  release(&span);
+  aesd_arena_destroy(&arena);
+  TEST_ASSERT_EQUAL_UINT(1, cache.count);
+  TEST_ASSERT_EQUAL(128, cache.bytes);
+
+  append(&arena, &span, "0123456789abcdefghij\n");
+  TEST_ASSERT_EQUAL_PTR_MESSAGE(chunk, arena.current, "A chunk of the same size class should be reused");
+  TEST_ASSERT_EQUAL_UINT(0, cache.count);
+
+  // a chunk too large for any size class is freed
+  struct aesd_buffer_entry large = {0};
+  char text[2000];
+  memset(text, 'x', sizeof(text) - 1);
+  text[sizeof(text) - 1] = '\0';
+  append(&arena, &large, text);
+  release(&large);
+  release(&span);
+  aesd_arena_destroy(&arena);
+  TEST_ASSERT_EQUAL_UINT(1, cache.count);
+  TEST_ASSERT_EQUAL_UINT(1, aesd_arena_cache_shrink(&cache, 8));
+  TEST_ASSERT_EQUAL(0, cache.bytes);
+  aesd_arena_cache_destroy(&cache);
+}
+
+void test_arena_cache_reuses_first_chunks_of_short_lived_arenas() {
+  struct aesd_arena_cache cache;
+  struct aesd_arena arena;
+  struct aesd_buffer_entry entry = {0};
+  aesd_arena_cache_init(&cache, AESD_ARENA_CHUNK_SIZE, 256 * 1024);
+
+  // one echo per open file: an arena written once, whose chunk is freed when its entry is evicted
+  aesd_arena_init(&arena, AESD_ARENA_CHUNK_SIZE);
+  arena.cache = &cache;
+  append(&arena, &entry, "line\n");
+  struct aesd_arena_chunk *chunk = arena.current;
+  TEST_ASSERT_TRUE(sizeof(struct aesd_arena_chunk) + chunk->size < AESD_ARENA_CHUNK_SIZE);
+  aesd_arena_destroy(&arena);
+  release(&entry);
+  TEST_ASSERT_EQUAL_UINT_MESSAGE(1, cache.count, "The first chunk of an arena written once should be cached");
+  TEST_ASSERT_EQUAL(sizeof(struct aesd_arena_chunk) + chunk->size, cache.bytes);
+
+  for (int i = 0; i < 100; i++) {
+    aesd_arena_init(&arena, AESD_ARENA_CHUNK_SIZE);
+    arena.cache = &cache;
+    append(&arena, &entry, "line\n");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(chunk, arena.current, "The next arena written once should reuse the chunk");
+    aesd_arena_destroy(&arena);
+    release(&entry);
+  }
+  TEST_ASSERT_EQUAL_UINT(1, cache.count);
+  aesd_arena_cache_destroy(&cache);
+  TEST_ASSERT_EQUAL(0, cache.bytes);
+}
+
+void test_arena_short_lived_arenas_pin_little() {
+  static struct aesd_buffer_entry entries[1000];
+  struct aesd_arena arena;
+  size_t pinned = 0;
+
+  // each line written through an arena of its own, like one echo per open file
+  for (int i = 0; i < 1000; i++) {
+    aesd_arena_init(&arena, AESD_ARENA_CHUNK_SIZE);
+    append(&arena, &entries[i], "line\n");
+    pinned += sizeof(struct aesd_arena_chunk) + arena.current->size;
+    aesd_arena_destroy(&arena);
+  }
+  TEST_ASSERT_TRUE_MESSAGE(pinned <= 1000 * 2 * (sizeof(struct aesd_arena_chunk) + 5),
+                           "A single short write should not keep a whole chunk alive");
+  for (int i = 0; i < 1000; i++) {
+    release(&entries[i]);
+  }
+
+  // an arena that keeps writing grows to full chunks
+  struct aesd_buffer_entry span = {0};
+  aesd_arena_init(&arena, AESD_ARENA_CHUNK_SIZE);
+  for (int i = 0; i < 10000; i++) {
+    append(&arena, &span, "line\n");
+    release(&span);
+  }
+  TEST_ASSERT_EQUAL(AESD_ARENA_CHUNK_SIZE, sizeof(struct aesd_arena_chunk) + arena.current->size);
+  aesd_arena_destroy(&arena);
+}
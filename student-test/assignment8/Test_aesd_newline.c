@@ -0,0 +1,109 @@
+#include "../../aesd-char-driver/aesd-newline.h"
+#include "unity.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Compares aesd_find_newlines with a memchr loop.  The vectorized paths scan 64 byte blocks, so the lengths,
+ * newline offsets and max_positions below straddle block boundaries and stop part way through a block.
+ */
+#define MAX_LENGTH 200
+#define MAX_NEWLINES (MAX_LENGTH + 1)
+
+static size_t reference_newlines(const char *buffer, size_t size, size_t *positions, size_t max_positions) {
+  size_t count = 0;
+  const char *p = buffer;
+
+  while (count < max_positions && (p = memchr(p, '\n', size - (p - buffer))) != NULL) {
+    positions[count++] = p - buffer;
+    p++;
+  }
+  return count;
+}
+
+/**
+ * Checks @param size bytes at @param buffer with every max_positions in @param limits, and walks the buffer the
+ * way aesd_write_iter does with a batch of 3 to check resuming part way through a block
+ */
+static void check_buffer_once(const char *buffer, size_t size) {
+  static const size_t limits[] = {1, 2, 3, 7, 16, 63, 64, 65, MAX_NEWLINES};
+  size_t expected[MAX_NEWLINES];
+  size_t actual[MAX_NEWLINES];
+
+  for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+    size_t expected_count = reference_newlines(buffer, size, expected, limits[i]);
+    // a canary after the last position the scanner may write
+    actual[limits[i] < MAX_NEWLINES ? limits[i] : 0] = SIZE_MAX;
+    size_t actual_count = aesd_find_newlines(buffer, size, actual, limits[i]);
+    TEST_ASSERT_EQUAL_MESSAGE(expected_count, actual_count, "Wrong number of newlines found");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, actual, actual_count * sizeof(size_t), "Wrong newline offsets");
+    if (limits[i] < MAX_NEWLINES) {
+      TEST_ASSERT_EQUAL_MESSAGE(SIZE_MAX, actual[limits[i]], "Wrote past max_positions");
+    }
+  }
+
+  size_t expected_count = reference_newlines(buffer, size, expected, MAX_NEWLINES);
+  size_t found = 0;
+  size_t start = 0;
+  size_t batch;
+  while ((batch = aesd_find_newlines(buffer + start, size - start, actual + found, 3)) > 0) {
+    for (size_t i = found; i < found + batch; i++) {
+      actual[i] += start;
+    }
+    found += batch;
+    start = actual[found - 1] + 1;
+  }
+  TEST_ASSERT_EQUAL_MESSAGE(expected_count, found, "Resuming after a full batch lost newlines");
+  TEST_ASSERT_EQUAL_MEMORY(expected, actual, found * sizeof(size_t));
+}
+
+/**
+ * Checks the buffer with the AVX2 scanner where the CPU has it, and with SSE2
+ */
+static void check_buffer(const char *buffer, size_t size) {
+  aesd_newline_disable_avx2 = 0;
+  check_buffer_once(buffer, size);
+  aesd_newline_disable_avx2 = 1;
+  check_buffer_once(buffer, size);
+  aesd_newline_disable_avx2 = 0;
+}
+
+void test_newlines_at_block_boundaries() {
+  static const size_t offsets[] = {0, 1, 31, 32, 62, 63, 64, 65, 126, 127, 128, 129, 191, 192};
+  char buffer[MAX_LENGTH];
+
+  for (size_t size = 0; size <= MAX_LENGTH; size++) {
+    // no newline, then a single one at each interesting offset, then one at every offset
+    memset(buffer, 'a', sizeof(buffer));
+    check_buffer(buffer, size);
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+      memset(buffer, 'a', sizeof(buffer));
+      if (offsets[i] < size) {
+        buffer[offsets[i]] = '\n';
+        check_buffer(buffer, size);
+      }
+    }
+    memset(buffer, '\n', sizeof(buffer));
+    check_buffer(buffer, size);
+  }
+}
+
+void test_newlines_with_embedded_nuls() {
+  char storage[MAX_LENGTH + 64];
+  uint32_t random = 2463534242u;
+
+  for (int round = 0; round < 2000; round++) {
+    size_t size = round % (MAX_LENGTH + 1);
+    // scan at every alignment within a block
+    char *buffer = storage + round % 64;
+    for (size_t i = 0; i < size; i++) {
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      // mostly NULs and newlines, with bytes that differ from a newline by one bit
+      static const char bytes[] = {'\0', '\n', '\0', '\n', 'x', '\n' ^ 0x80, '\n' ^ 0x01, '\0'};
+      buffer[i] = bytes[random % sizeof(bytes)];
+    }
+    check_buffer(buffer, size);
+  }
+}
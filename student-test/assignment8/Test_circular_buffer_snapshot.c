@@ -0,0 +1,178 @@
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "unity.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * One writer adds entries while reader threads take snapshots without a lock.  Entries point into a pattern that
+ * repeats every PATTERN_PERIOD bytes, so the bytes of any entry are known from its offset and a torn snapshot shows
+ * up as a wrong size, offset or content.  Entries are never freed, the driver defers that to SRCU.
+ */
+#define WRITES 200000
+#define READERS 4
+#define PATTERN_PERIOD 4096
+#define MAX_ENTRY_SIZE 97
+
+static char pattern[PATTERN_PERIOD + MAX_ENTRY_SIZE];
+static size_t prefix[WRITES + 1];
+static struct aesd_circular_buffer snapshot_buffer;
+static int writer_done;
+
+struct reader_stats {
+  unsigned long snapshots;
+  unsigned long errors;
+};
+
+static size_t entry_size(uint32_t seq) { return 1 + (seq * 7919u) % MAX_ENTRY_SIZE; }
+
+static char pattern_byte(size_t offset) {
+  offset %= PATTERN_PERIOD;
+  return (char)((offset * 31 + offset / 251) & 0xff);
+}
+
+static bool entry_matches(uint32_t seq, const struct aesd_buffer_entry *entry) {
+  if (entry->size != entry_size(seq) || entry->offset != prefix[seq]) {
+    return false;
+  }
+  for (size_t i = 0; i < entry->size; i++) {
+    if (entry->buffptr[i] != pattern_byte(entry->offset + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool writing(void) { return !__atomic_load_n(&writer_done, __ATOMIC_RELAXED); }
+
+static void *random_reader(void *arg) {
+  struct reader_stats *stats = arg;
+  uint32_t random = 2463534242u;
+
+  while (writing()) {
+    size_t size = aesd_circular_buffer_snapshot_size(&snapshot_buffer);
+    struct aesd_buffer_position position;
+    struct aesd_buffer_entry entry;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    size_t fpos = size > 0 ? random % size : 0;
+
+    if (!aesd_circular_buffer_snapshot_fpos(&snapshot_buffer, fpos, &position) ||
+        aesd_circular_buffer_snapshot_entry(&snapshot_buffer, &position, &entry) != 0) {
+      continue;
+    }
+    if (!entry_matches(position.seq, &entry) || position.offset >= entry.size ||
+        entry.offset + position.offset - prefix[position.generation] != fpos) {
+      stats->errors++;
+    }
+    stats->snapshots++;
+  }
+  return NULL;
+}
+
+/**
+ * Walks entries the way aesd_read does, from the oldest one on until an eviction moves the positions
+ */
+static void *sequential_reader(void *arg) {
+  struct reader_stats *stats = arg;
+  struct aesd_buffer_position position;
+  bool have_position = false;
+
+  while (writing()) {
+    struct aesd_buffer_entry entry;
+    if (!have_position) {
+      have_position = aesd_circular_buffer_snapshot_fpos(&snapshot_buffer, 0, &position);
+      continue;
+    }
+    int ret = aesd_circular_buffer_snapshot_entry(&snapshot_buffer, &position, &entry);
+    if (ret == -ESTALE) {
+      have_position = false;
+      continue;
+    }
+    if (ret) {
+      continue;
+    }
+    if (!entry_matches(position.seq, &entry)) {
+      stats->errors++;
+    }
+    position.seq++;
+    position.offset = 0;
+    stats->snapshots++;
+  }
+  return NULL;
+}
+
+/**
+ * Copies runs of writes by sequence number the way AESDCHAR_IOCREADENTRIES does, stopping a run only when the writer
+ * evicts the next write
+ */
+static void *range_reader(void *arg) {
+  struct reader_stats *stats = arg;
+
+  while (writing()) {
+    struct aesd_buffer_position position;
+    struct aesd_buffer_entry entry;
+    size_t fpos;
+    if (!aesd_circular_buffer_snapshot_index(&snapshot_buffer, 0, &position, &fpos, &entry)) {
+      continue;
+    }
+    uint32_t seq = position.seq;
+    do {
+      if (!entry_matches(seq, &entry)) {
+        stats->errors++;
+      }
+      stats->snapshots++;
+      seq++;
+    } while (seq - position.seq < 256 && aesd_circular_buffer_snapshot_seq(&snapshot_buffer, seq, &entry) == 0);
+  }
+  return NULL;
+}
+
+void test_circular_buffer_snapshots_with_concurrent_writer() {
+  pthread_t readers[READERS];
+  struct reader_stats stats[READERS] = {0};
+
+  for (size_t i = 0; i < sizeof(pattern); i++) {
+    pattern[i] = pattern_byte(i);
+  }
+  for (uint32_t seq = 0; seq < WRITES; seq++) {
+    prefix[seq + 1] = prefix[seq] + entry_size(seq);
+  }
+  TEST_ASSERT_EQUAL(0, aesd_circular_buffer_init_capacity(&snapshot_buffer, 64));
+  TEST_ASSERT_EQUAL(0, aesd_circular_buffer_set_retention(&snapshot_buffer, 0, 2000, NULL, NULL));
+  __atomic_store_n(&writer_done, 0, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < READERS; i++) {
+    void *(*reader)(void *) = i == 0 ? sequential_reader : i == 1 ? range_reader : random_reader;
+    TEST_ASSERT_EQUAL(0, pthread_create(&readers[i], NULL, reader, &stats[i]));
+  }
+  for (uint32_t seq = 0; seq < WRITES; seq++) {
+    struct aesd_buffer_entry entry = {
+        .buffptr = pattern + prefix[seq] % PATTERN_PERIOD,
+        .size = entry_size(seq),
+    };
+    aesd_circular_buffer_add_entry_evict(&snapshot_buffer, &entry, NULL, NULL);
+    if (seq % 1024 == 0) {
+      // let the readers run on a single CPU too
+      sched_yield();
+    }
+  }
+  __atomic_store_n(&writer_done, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(readers[i], NULL);
+  }
+
+  for (int i = 0; i < READERS; i++) {
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(0, stats[i].errors, "A reader saw an inconsistent snapshot");
+  }
+  TEST_ASSERT_EQUAL(prefix[WRITES] - prefix[WRITES - aesd_circular_buffer_count(&snapshot_buffer)],
+                    aesd_circular_buffer_snapshot_size(&snapshot_buffer));
+
+  struct aesd_buffer_entry entry;
+  TEST_ASSERT_EQUAL(-ESTALE, aesd_circular_buffer_snapshot_seq(&snapshot_buffer, 0, &entry));
+  TEST_ASSERT_EQUAL(-ENOENT, aesd_circular_buffer_snapshot_seq(&snapshot_buffer, WRITES, &entry));
+  TEST_ASSERT_EQUAL(0, aesd_circular_buffer_snapshot_seq(&snapshot_buffer, WRITES - 1, &entry));
+  TEST_ASSERT_TRUE(entry_matches(WRITES - 1, &entry));
+  aesd_circular_buffer_destroy(&snapshot_buffer);
+}